@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+
+# Generates a synthetic module for the compile time benchmark, as LLVM IR or
+# as C, from a seed, so that every commit compiles the same code:
+#
+#   --functions        number of functions, f0 is the root of the call graph
+#   --blocks           basic blocks per function, chained by branches, every
+#                      third one closing a loop
+#   --pointer-density  fraction of the statements touching memory through
+#                      pointers (loads, stores, pointer copies and GEPs),
+#                      the rest is integer arithmetic
+#   --call-graph       chain:  f(i) calls f(i + 1)
+#                      tree:   f(i) calls f(2i + 1) and f(2i + 2)
+#                      random: f(i) calls 3 random functions after it
+#                      star:   f0 calls every other function
+#                      indirect: random, through a table of function pointers
+
+import argparse
+import random
+import sys
+
+STATEMENTS = 6
+
+
+def callees(i, n, shape, rng):
+    if shape == "chain":
+        return [i + 1] if i + 1 < n else []
+    if shape == "tree":
+        return [c for c in (2 * i + 1, 2 * i + 2) if c < n]
+    if shape == "star":
+        return list(range(1, n)) if i == 0 else []
+    # random and indirect; only forward calls, so the call graph is a DAG
+    return sorted(rng.sample(range(i + 1, n), min(3, n - i - 1)))
+
+
+class IRWriter:
+    def __init__(self, args, rng):
+        self.args = args
+        self.rng = rng
+        self.out = []
+        self.tmp = 0
+
+    def t(self):
+        self.tmp += 1
+        return "%%t%d" % self.tmp
+
+    def emit(self, line):
+        self.out.append(line)
+
+    def statement(self, ints, ptrs):
+        rng = self.rng
+        if rng.random() < self.args.pointer_density:
+            kind = rng.randrange(4)
+            p = rng.choice(ptrs)
+            if kind == 0:
+                v = self.t()
+                self.emit("  %s = load i64, i64* %s, align 8" % (v, p))
+                ints.append(v)
+            elif kind == 1:
+                self.emit("  store i64 %s, i64* %s, align 8" % (rng.choice(ints), p))
+            elif kind == 2:
+                idx = self.t()
+                g = self.t()
+                self.emit("  %s = and i64 %s, 15" % (idx, rng.choice(ints)))
+                self.emit("  %s = getelementptr inbounds i64, i64* %s, i64 %s" % (g, p, idx))
+                ptrs.append(g)
+            else:
+                # a pointer copied through memory, an Anderson load/store constraint
+                self.emit("  store i64* %s, i64** %%slot, align 8" % p)
+                v = self.t()
+                self.emit("  %s = load i64*, i64** %%slot, align 8" % v)
+                ptrs.append(v)
+        else:
+            v = self.t()
+            op = rng.choice(["add", "mul", "xor", "sub"])
+            self.emit("  %s = %s i64 %s, %s" % (v, op, rng.choice(ints), rng.choice(ints + ["7", "13"])))
+            ints.append(v)
+
+    def function(self, i, calls):
+        a = self.args
+        self.tmp = 0
+        self.emit("define i64 @f%d(i64* %%p, i64 %%n) {" % i)
+        self.emit("entry:")
+        self.emit("  %buf = alloca [16 x i64], align 16")
+        self.emit("  %slot = alloca i64*, align 8")
+        self.emit("  %b = getelementptr inbounds [16 x i64], [16 x i64]* %buf, i64 0, i64 0")
+        self.emit("  br label %bb0")
+        ints = ["%n"]
+        ptrs = ["%p", "%b", "getelementptr inbounds ([64 x i64], [64 x i64]* @g, i64 0, i64 0)"]
+        for b in range(a.blocks):
+            self.emit("bb%d:" % b)
+            # values are only reused within a block, no phis needed
+            local_ints, local_ptrs = list(ints), list(ptrs)
+            for _ in range(STATEMENTS):
+                self.statement(local_ints, local_ptrs)
+            for callee in calls[b::a.blocks]:
+                v = self.t()
+                if a.call_graph == "indirect":
+                    fp = self.t()
+                    self.emit("  %s = load i64 (i64*, i64)*, i64 (i64*, i64)** getelementptr inbounds "
+                              "([%d x i64 (i64*, i64)*], [%d x i64 (i64*, i64)*]* @table, i64 0, i64 %d), align 8"
+                              % (fp, a.functions, a.functions, callee))
+                    self.emit("  %s = call i64 %s(i64* %s, i64 %s)" % (v, fp, self.rng.choice(local_ptrs), local_ints[-1]))
+                else:
+                    self.emit("  %s = call i64 @f%d(i64* %s, i64 %s)" % (v, callee, self.rng.choice(local_ptrs), local_ints[-1]))
+                local_ints.append(v)
+            if b + 1 == a.blocks:
+                self.emit("  ret i64 %s" % local_ints[-1])
+                continue
+            c = self.t()
+            self.emit("  %s = icmp slt i64 %s, %s" % (c, local_ints[-1], self.rng.choice(local_ints)))
+            # every third block loops back to the previous one
+            other = "bb%d" % (b - 1) if b % 3 == 2 else "bb%d" % min(b + 2, a.blocks - 1)
+            self.emit("  br i1 %s, label %%bb%d, label %%%s" % (c, b + 1, other))
+        self.emit("}")
+        self.emit("")
+
+    def module(self):
+        a = self.args
+        self.emit("@g = global [64 x i64] zeroinitializer, align 16")
+        if a.call_graph == "indirect":
+            entries = ", ".join("i64 (i64*, i64)* @f%d" % i for i in range(a.functions))
+            self.emit("@table = global [%d x i64 (i64*, i64)*] [%s], align 8" % (a.functions, entries))
+        self.emit("")
+        for i in range(a.functions):
+            self.function(i, callees(i, a.functions, a.call_graph, self.rng))
+        self.emit("define i32 @main() {")
+        self.emit("  %r = call i64 @f0(i64* getelementptr inbounds ([64 x i64], [64 x i64]* @g, i64 0, i64 0), i64 3)")
+        self.emit("  ret i32 0")
+        self.emit("}")
+        return "\n".join(self.out) + "\n"
+
+
+class CWriter:
+    def __init__(self, args, rng):
+        self.args = args
+        self.rng = rng
+        self.out = []
+
+    def emit(self, line):
+        self.out.append(line)
+
+    def statement(self, ints, ptrs, n):
+        rng = self.rng
+        if rng.random() < self.args.pointer_density:
+            kind = rng.randrange(4)
+            p = rng.choice(ptrs)
+            if kind == 0:
+                v = "v%d" % n
+                self.emit("    long %s = *%s;" % (v, p))
+                # clang -O1 would drop the loads whose value isn't used
+                self.emit("    r ^= %s;" % v)
+                ints.append(v)
+            elif kind == 1:
+                self.emit("    *%s = %s;" % (p, rng.choice(ints)))
+            elif kind == 2:
+                v = "q%d" % n
+                self.emit("    long *%s = %s + (%s & 15);" % (v, p, rng.choice(ints)))
+                ptrs.append(v)
+            else:
+                v = "q%d" % n
+                self.emit("    slot = %s;" % p)
+                self.emit("    long *%s = slot;" % v)
+                ptrs.append(v)
+        else:
+            v = "v%d" % n
+            op = rng.choice(["+", "*", "^", "-"])
+            self.emit("    long %s = %s %s %s;" % (v, rng.choice(ints), op, rng.choice(ints + ["7", "13"])))
+            ints.append(v)
+
+    def function(self, i, calls):
+        a = self.args
+        self.emit("long f%d(long *p, long n) {" % i)
+        self.emit("    long buf[16] = {0};")
+        self.emit("    long *volatile slot;")
+        self.emit("    long r = n;")
+        n = 0
+        for b in range(a.blocks):
+            ints, ptrs = ["n", "r"], ["p", "buf", "g"]
+            self.emit("    if (r < %d) {" % (b * 7 % 23) if b % 3 else "    for (int i%d = 0; i%d < (n & 3); i%d++) {" % (b, b, b))
+            for _ in range(STATEMENTS):
+                n += 1
+                self.statement(ints, ptrs, n)
+            for callee in calls[b::a.blocks]:
+                target = "table[%d]" % callee if a.call_graph == "indirect" else "f%d" % callee
+                self.emit("    r += %s(%s, %s);" % (target, self.rng.choice(ptrs), ints[-1]))
+            self.emit("    r += %s;" % ints[-1])
+            self.emit("    }")
+        self.emit("    return r;")
+        self.emit("}")
+        self.emit("")
+
+    def module(self):
+        a = self.args
+        self.emit("long g[64];")
+        for i in range(a.functions):
+            self.emit("long f%d(long *p, long n);" % i)
+        if a.call_graph == "indirect":
+            self.emit("long (*table[%d])(long *, long) = {%s};"
+                      % (a.functions, ", ".join("f%d" % i for i in range(a.functions))))
+        self.emit("")
+        for i in range(a.functions):
+            self.function(i, callees(i, a.functions, a.call_graph, self.rng))
+        self.emit("int main(void) { return (int) f0(g, 3); }")
+        return "\n".join(self.out) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--lang", choices=["ll", "c"], default="ll")
+    parser.add_argument("--functions", type=int, default=500)
+    parser.add_argument("--blocks", type=int, default=20)
+    parser.add_argument("--pointer-density", type=float, default=0.3)
+    parser.add_argument("--call-graph", choices=["chain", "tree", "random", "star", "indirect"], default="random")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("-o", "--out", help="write the module here instead of stdout")
+    args = parser.parse_args()
+    if args.functions < 1 or args.blocks < 1:
+        parser.error("--functions and --blocks must be positive")
+
+    rng = random.Random(args.seed)
+    writer = IRWriter(args, rng) if args.lang == "ll" else CWriter(args, rng)
+    text = writer.module()
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == "__main__":
+    main()
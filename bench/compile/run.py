@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+
+# Compile time of the passes on the synthetic modules of gen.py. Every module
+# goes through opt once without a pass, the baseline, and once per pass
+# (legacy plugins, plus the new pass manager plugin when it is built). Prints
+# (or writes) a single JSON document with, for each module and pass:
+#
+#   seconds             wall time of opt, median of the runs
+#   overhead_seconds    seconds minus the baseline of the module
+#   max_rss_kb          peak resident set size of opt, largest of the runs
+#   instructions_added  instructions of the output minus those of the input
+#
+# The modules come from fixed seeds, so documents of different commits are
+# comparable: --compare old.json lists the passes whose overhead grew by more
+# than --threshold and exits with 1 if there is any.
+
+import argparse
+import json
+import os
+import platform
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# name, language and gen.py parameters
+MODULES = [
+    ("random", "ll", {"functions": 1000, "blocks": 20, "pointer_density": 0.3, "call_graph": "random"}),
+    ("pointers", "ll", {"functions": 500, "blocks": 20, "pointer_density": 0.8, "call_graph": "random"}),
+    ("deep", "ll", {"functions": 50, "blocks": 400, "pointer_density": 0.3, "call_graph": "chain"}),
+    ("tree", "ll", {"functions": 2000, "blocks": 8, "pointer_density": 0.3, "call_graph": "tree"}),
+    ("star", "ll", {"functions": 1000, "blocks": 10, "pointer_density": 0.3, "call_graph": "star"}),
+    ("indirect", "ll", {"functions": 1000, "blocks": 20, "pointer_density": 0.3, "call_graph": "indirect"}),
+    ("c-random", "c", {"functions": 500, "blocks": 20, "pointer_density": 0.3, "call_graph": "random"}),
+]
+
+# name, plugin relative to the source tree, opt flag
+LEGACY_PASSES = [
+    ("hello", "HelloWorldPass/Hello.so", "-hello"),
+    ("Anderson", "AndersonPointerAnalysisPass/Anderson.so", "-Anderson"),
+    ("LearnSanitizer", "MySanitizer/LearnSanitizer.so", "-LearnSanitizer"),
+    ("Fuzzing", "FuzzingPass/FuzzingPass.so", "-Fuzzing"),
+]
+
+PLUGIN = "Plugin/SecurityPasses.so"
+PLUGIN_PIPELINES = ["hello", "anderson", "learnsan", "fuzzing", "fuzzing,learnsan"]
+
+ENV_PREFIXES = ("FUZZING_", "LEARNSAN_", "HELLO_", "SECURITY_")
+
+
+def clean_env():
+    # the options of the passes would make the numbers of two runs differ
+    return {k: v for k, v in os.environ.items() if not k.startswith(ENV_PREFIXES)}
+
+
+def measure(argv, env):
+    start = time.perf_counter()
+    proc = subprocess.Popen(argv, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, env=env)
+    # the output of Anderson is large, it is read while waiting
+    stderr = proc.stderr.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    seconds = time.perf_counter() - start
+    # reaped here, Popen must not wait for it
+    proc.returncode = status
+    if status:
+        sys.stderr.write(stderr.decode(errors="replace")[-2000:])
+        raise subprocess.CalledProcessError(status, argv)
+    return seconds, usage.ru_maxrss
+
+
+INSTRUCTION = re.compile(rb"^  [^ ;]", re.M)
+
+
+def count_instructions(llvm_dis, path):
+    text = subprocess.run([llvm_dis, path, "-o", "-"], stdout=subprocess.PIPE, check=True).stdout
+    return len(INSTRUCTION.findall(text))
+
+
+def generate(args, name, lang, params):
+    path = os.path.join(args.build_dir, name)
+    source = path + "." + lang
+    argv = [sys.executable, os.path.join(SCRIPT_DIR, "gen.py"), "--lang", lang, "-o", source]
+    for key, value in params.items():
+        argv += ["--" + key.replace("_", "-"), str(value)]
+    subprocess.run(argv, check=True)
+
+    # the parsing of the source is not part of the numbers
+    bitcode = path + ".bc"
+    if lang == "ll":
+        subprocess.run([args.opt, source, "-o", bitcode], check=True)
+    else:
+        # -O1 keeps the locals in registers, as in the IR modules; gen.py feeds
+        # every load into the result, so that none is dropped
+        subprocess.run([args.clang, "-O1", "-fno-inline", "-emit-llvm", "-c", source, "-o", bitcode], check=True)
+    return bitcode
+
+
+def bench_module(args, bitcode, configs, env):
+    output = bitcode + ".out.bc"
+    base = [args.opt, "-enable-new-pm=0", bitcode, "-o", output]
+    runs = [measure(base, env) for _ in range(args.reps)]
+    baseline = statistics.median(r[0] for r in runs)
+    input_instructions = count_instructions(args.llvm_dis, bitcode)
+
+    results = {"instructions": input_instructions, "baseline_seconds": baseline, "passes": {}}
+    for name, argv in configs:
+        argv = argv + [bitcode, "-o", output]
+        runs = [measure(argv, env) for _ in range(args.reps)]
+        seconds = statistics.median(r[0] for r in runs)
+        results["passes"][name] = {
+            "seconds": seconds,
+            "overhead_seconds": seconds - baseline,
+            "max_rss_kb": max(r[1] for r in runs),
+            "instructions_added": count_instructions(args.llvm_dis, output) - input_instructions,
+        }
+    return results
+
+
+def pass_configs(args):
+    configs = []
+    for name, plugin, flag in LEGACY_PASSES:
+        path = os.path.join(args.src, plugin)
+        if os.path.isfile(path):
+            configs.append((name, [args.opt, "-enable-new-pm=0", "-load", path, flag]))
+        else:
+            print("skipping %s, %s is not built" % (name, path), file=sys.stderr)
+    plugin = os.path.join(args.src, PLUGIN)
+    if os.path.isfile(plugin):
+        for pipeline in PLUGIN_PIPELINES:
+            configs.append(("plugin:" + pipeline, [args.opt, "-load-pass-plugin=" + plugin, "-passes=" + pipeline]))
+    return configs
+
+
+def compare(result, baseline, threshold):
+    regressions = []
+    for module, old in baseline.get("modules", {}).items():
+        new = result.get("modules", {}).get(module)
+        if not new:
+            continue
+        for name, old_pass in old["passes"].items():
+            new_pass = new["passes"].get(name)
+            if not new_pass:
+                continue
+            # below 10ms the noise of the baseline dominates
+            old_s, new_s = max(old_pass["overhead_seconds"], 0.01), max(new_pass["overhead_seconds"], 0.01)
+            if new_s > old_s * (1 + threshold):
+                regressions.append("%s %s: %.3fs -> %.3fs (+%.0f%%)" % (module, name, old_s, new_s,
+                                                                       100 * (new_s / old_s - 1)))
+    return regressions
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(["git", "rev-parse", "HEAD"], stderr=subprocess.DEVNULL,
+                                       cwd=SCRIPT_DIR).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--src", default=os.path.join(SCRIPT_DIR, "..", "..", "src"))
+    parser.add_argument("--build-dir", default="build")
+    parser.add_argument("--opt", default="opt")
+    parser.add_argument("--llvm-dis", default="llvm-dis")
+    parser.add_argument("--clang", default="clang", help="compiles the C modules, skipped if missing")
+    parser.add_argument("--reps", type=int, default=3, help="runs of opt per module and pass")
+    parser.add_argument("--modules", help="comma separated subset of the modules")
+    parser.add_argument("--out", help="write the JSON here instead of stdout")
+    parser.add_argument("--load", help="compare this document instead of running the benchmark")
+    parser.add_argument("--compare", help="document of an earlier run")
+    parser.add_argument("--threshold", type=float, default=0.10, help="overhead growth reported by --compare")
+    args = parser.parse_args()
+
+    if args.load:
+        with open(args.load) as f:
+            result = json.load(f)
+    else:
+        os.makedirs(args.build_dir, exist_ok=True)
+        env = clean_env()
+        configs = pass_configs(args)
+        selected = args.modules.split(",") if args.modules else None
+        version = subprocess.run([args.opt, "--version"], stdout=subprocess.PIPE).stdout.decode()
+        result = {
+            "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+            "git_revision": git_revision(),
+            "machine": platform.machine(),
+            "llvm_version": (re.findall(r"version (\S+)", version) or [None])[0],
+            "reps": args.reps,
+            "modules": {},
+        }
+        for name, lang, params in MODULES:
+            if selected and name not in selected:
+                continue
+            try:
+                bitcode = generate(args, name, lang, params)
+            except (OSError, subprocess.CalledProcessError):
+                print("skipping %s, it does not compile" % name, file=sys.stderr)
+                continue
+            result["modules"][name] = dict(params, language=lang, **bench_module(args, bitcode, configs, env))
+
+        text = json.dumps(result, indent=2)
+        if args.out:
+            with open(args.out, "w") as f:
+                f.write(text + "\n")
+        else:
+            print(text)
+
+    if args.compare:
+        with open(args.compare) as f:
+            regressions = compare(result, json.load(f), args.threshold)
+        for line in regressions:
+            print("regression: " + line, file=sys.stderr)
+        sys.exit(1 if regressions else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "coverage-map.h"
+
+/*
+ * Microbenchmark of the coverage map processing done after every execution
+ * (classify, has_new_bits, hash, reset), per kernel, map size and fraction
+ * of edges hit. "full_scan" is the per byte loop over the whole map that the
+ * kernels replace. Every kernel must give the same classified map, virgin
+ * map and hash as the scalar one, the result is printed as "consistent".
+ *
+ * The output is one JSON document on stdout.
+ */
+
+#define EXECS 2000
+
+static const char* kernel_names[] = { "scalar", "ssse3", "avx2" };
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* the trace of one execution: hit edges clustered the way sequential IDs are */
+static void fill_trace(uint8_t* trace, size_t size, double density, uint32_t seed) {
+    size_t edges = size * density;
+    uint32_t state = seed;
+    for (size_t i = 0; i < edges; i++) {
+        size_t base = next_random(&state) % size;
+        size_t run = 1 + next_random(&state) % 8;
+        for (size_t j = 0; j < run && i < edges; j++, i++)
+            trace[(base + j) % size] += 1 + next_random(&state) % 200;
+    }
+}
+
+static uint8_t classify_byte(uint8_t c) {
+    return c == 0 ? 0 : c == 1 ? 1 : c == 2 ? 2 : c == 3 ? 4 : c < 8 ? 8 :
+           c < 16 ? 16 : c < 32 ? 32 : c < 128 ? 64 : 128;
+}
+
+static uint64_t full_scan(uint8_t* trace, uint8_t* virgin, size_t size) {
+    uint64_t h = 0;
+    for (size_t i = 0; i < size; i++) {
+        uint8_t c = classify_byte(trace[i]);
+        virgin[i] &= ~c;
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    memset(trace, 0, size);
+    return h;
+}
+
+/* one map checked against scalar, returns 0 on mismatch */
+static int check_kernel(enum coverage_kernel kernel, size_t size, double density) {
+    uint8_t* traces[2];
+    uint8_t* virgins[2];
+    struct coverage_map maps[2];
+    uint64_t hashes[2];
+    int news[2];
+
+    for (int i = 0; i < 2; i++) {
+        traces[i] = aligned_alloc(COVERAGE_LINE, size);
+        virgins[i] = malloc(size);
+        memset(virgins[i], 0xff, size);
+        coverage_map_init(&maps[i], traces[i], size);
+        coverage_map_set_kernel(&maps[i], i ? kernel : COVERAGE_SCALAR);
+    }
+
+    int ok = 1;
+    for (uint32_t exec = 0; exec < 8 && ok; exec++) {
+        for (int i = 0; i < 2; i++) {
+            fill_trace(traces[i], size, density, 1 + exec);
+            coverage_classify(&maps[i]);
+            news[i] = coverage_has_new_bits(&maps[i], virgins[i]);
+            hashes[i] = coverage_hash(&maps[i]);
+        }
+        ok = news[0] == news[1] && hashes[0] == hashes[1] &&
+             !memcmp(traces[0], traces[1], size) && !memcmp(virgins[0], virgins[1], size);
+        for (int i = 0; i < 2; i++)
+            coverage_reset(&maps[i]);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        // reset must leave the whole map zero
+        for (size_t j = 0; j < size; j++)
+            ok = ok && !traces[i][j];
+        coverage_map_destroy(&maps[i]);
+        free(traces[i]);
+        free(virgins[i]);
+    }
+    return ok;
+}
+
+int main() {
+    static const size_t sizes[] = { 1 << 16, 1 << 20 };
+    static const double densities[] = { 0.001, 0.01, 0.1 };
+    int consistent = 1;
+
+    printf("{\"execs\": %d, \"results\": [", EXECS);
+    int first = 1;
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (unsigned d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+            size_t size = sizes[s];
+            uint8_t* trace = aligned_alloc(COVERAGE_LINE, size);
+            uint8_t* virgin = malloc(size);
+            // the traces are prepared up front, only the processing is timed
+            uint8_t* samples = malloc(size * 16);
+            for (unsigned i = 0; i < 16; i++) {
+                memset(samples + i * size, 0, size);
+                fill_trace(samples + i * size, size, densities[d], 1 + i);
+            }
+
+            memset(virgin, 0xff, size);
+            double total = 0;
+            volatile uint64_t sink = 0;
+            for (unsigned e = 0; e < EXECS; e++) {
+                memcpy(trace, samples + (e % 16) * size, size);
+                double start = now();
+                sink += full_scan(trace, virgin, size);
+                total += now() - start;
+            }
+            printf("%s{\"map_size\": %zu, \"density\": %g, \"kernel\": \"full_scan\", \"ns_per_exec\": %.1f}",
+                   first ? "" : ", ", size, densities[d], total / EXECS * 1e9);
+            first = 0;
+
+            for (int k = COVERAGE_SCALAR; k <= COVERAGE_AVX2; k++) {
+                struct coverage_map map;
+                coverage_map_init(&map, trace, size);
+                if (!coverage_map_set_kernel(&map, k)) {
+                    coverage_map_destroy(&map);
+                    continue;
+                }
+                consistent &= check_kernel(k, size, densities[d]);
+
+                memset(virgin, 0xff, size);
+                double classify = 0, rest = 0;
+                size_t dirty = 0;
+                for (unsigned e = 0; e < EXECS; e++) {
+                    memcpy(trace, samples + (e % 16) * size, size);
+                    double start = now();
+                    dirty += coverage_classify(&map);
+                    double mid = now();
+                    sink += coverage_has_new_bits(&map, virgin);
+                    sink += coverage_hash(&map);
+                    coverage_reset(&map);
+                    classify += mid - start;
+                    rest += now() - mid;
+                }
+                printf(", {\"map_size\": %zu, \"density\": %g, \"kernel\": \"%s\", \"ns_per_exec\": %.1f, "
+                       "\"classify_ns\": %.1f, \"dirty_lines\": %zu}",
+                       size, densities[d], kernel_names[k], (classify + rest) / EXECS * 1e9,
+                       classify / EXECS * 1e9, dirty / EXECS);
+                coverage_map_destroy(&map);
+            }
+            free(samples);
+            free(virgin);
+            free(trace);
+        }
+    }
+    printf("], \"consistent\": %s}\n", consistent ? "true" : "false");
+    return !consistent;
+}
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+
+# Runs the FuzzingPass benchmarks built by the Makefile and prints (or
+# writes) a single JSON document:
+#
+#   bitmap       output of build/bitmap, see bitmap.c
+#   threads      for each FUZZING_THREADS build and thread count: time per
+#                scan of the kernel (median of the runs), its overhead over
+#                the plain build, and how many different maps the rounds of
+#                one run produced (1 when no update is lost)
+
+import argparse
+import json
+import os
+import platform
+import statistics
+import subprocess
+import time
+
+BUILDS = ["plain", "shared", "atomic", "private"]
+THREADS = [1, 2, 4, 8]
+
+
+def run_json(argv):
+    return json.loads(subprocess.run(argv, stdout=subprocess.PIPE, check=True).stdout)
+
+
+def bench_threads(build_dir, reps, iterations):
+    results = []
+    for threads in THREADS:
+        baseline = None
+        for build in BUILDS:
+            path = os.path.join(build_dir, "threads." + build)
+            if not os.path.isfile(path):
+                continue
+            runs = [run_json([path, str(threads), str(iterations)]) for _ in range(reps)]
+            ns = statistics.median(r["ns_per_scan"] for r in runs)
+            if build == "plain":
+                baseline = ns
+            results.append({
+                "build": build,
+                "threads": threads,
+                "ns_per_scan": ns,
+                "overhead": ns / baseline if baseline else None,
+                "distinct_maps": max(r["distinct_maps"] or 0 for r in runs) or None,
+            })
+    return results
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(["git", "rev-parse", "HEAD"], stderr=subprocess.DEVNULL,
+                                       cwd=os.path.dirname(os.path.abspath(__file__))).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--build-dir", default="build")
+    parser.add_argument("--reps", type=int, default=5, help="runs of every threads build")
+    parser.add_argument("--iterations", type=int, default=20000, help="scans per thread and round")
+    parser.add_argument("--out", help="write the JSON here instead of stdout")
+    args = parser.parse_args()
+
+    result = {
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "git_revision": git_revision(),
+        "machine": platform.machine(),
+        "cpus": os.cpu_count(),
+        "reps": args.reps,
+    }
+
+    bitmap = os.path.join(args.build_dir, "bitmap")
+    if os.path.isfile(bitmap):
+        result["bitmap"] = run_json([bitmap])
+    result["threads"] = bench_threads(args.build_dir, args.reps, args.iterations)
+
+    text = json.dumps(result, indent=2)
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+
+if __name__ == "__main__":
+    main()
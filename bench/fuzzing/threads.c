@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Multi-threaded kernel for the FUZZING_THREADS modes: every thread runs a
+ * small branchy state machine over its own buffer. The run is repeated with
+ * the map cleared in between, and the bucketed maps of the rounds are
+ * compared: lost updates show up as rounds that differ.
+ *
+ *   threads [threads] [iterations per thread] [rounds]
+ *
+ * Prints one JSON document. The plain build has no map and reports null.
+ */
+
+extern uint8_t* __afl_area_ptr __attribute__((weak));
+extern uint32_t __afl_map_size __attribute__((weak));
+
+static long iterations;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* counts tokens of a made up grammar, a branch per byte */
+__attribute__((noinline)) static int scan(const unsigned char* buf, size_t len) {
+    int state = 0, tokens = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = buf[i];
+        switch (state) {
+        case 0:
+            if (c < 64)
+                state = 1;
+            else if (c < 128)
+                state = 2;
+            break;
+        case 1:
+            if (c & 1)
+                tokens++;
+            state = c < 200 ? 0 : 3;
+            break;
+        case 2:
+            if (c == 255)
+                state = 3;
+            else if (c > 100)
+                state = 0;
+            break;
+        default:
+            tokens += c > 128;
+            state = 0;
+        }
+    }
+    return tokens;
+}
+
+static void* worker(void* arg) {
+    uint32_t seed = (uintptr_t) arg;
+    unsigned char buf[256];
+    long tokens = 0;
+
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = next_random(&seed);
+    for (long i = 0; i < iterations; i++) {
+        tokens += scan(buf, sizeof(buf));
+        buf[i & 255] += tokens;
+    }
+    return (void*) tokens;
+}
+
+/* AFL bucket of each counter, hashed (FNV-1a) */
+static uint64_t map_hash() {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < __afl_map_size; i++) {
+        uint8_t c = __afl_area_ptr[i];
+        c = c == 0 ? 0 : c == 1 ? 1 : c == 2 ? 2 : c == 3 ? 4 : c < 8 ? 8 :
+            c < 16 ? 16 : c < 32 ? 32 : c < 128 ? 64 : 128;
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int main(int argc, char** argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    iterations = argc > 2 ? atol(argv[2]) : 20000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+    pthread_t ids[64];
+    int has_map = &__afl_area_ptr != NULL;
+
+    if (threads < 1 || threads > 64)
+        threads = 4;
+
+    double total = 0;
+    int distinct = 0;
+    uint64_t hashes[64];
+    for (int r = 0; r < rounds && r < 64; r++) {
+        if (has_map)
+            memset(__afl_area_ptr, 0, __afl_map_size);
+
+        double start = now();
+        for (int t = 0; t < threads; t++)
+            pthread_create(&ids[t], NULL, worker, (void*) (uintptr_t) (t + 1));
+        for (int t = 0; t < threads; t++)
+            pthread_join(ids[t], NULL);
+        total += now() - start;
+
+        if (has_map) {
+            hashes[r] = map_hash();
+            int seen = 0;
+            for (int i = 0; i < r; i++)
+                seen |= hashes[i] == hashes[r];
+            distinct += !seen;
+        }
+    }
+
+    printf("{\"threads\": %d, \"iterations\": %ld, \"rounds\": %d, \"ns_per_scan\": %.2f, ",
+           threads, iterations, rounds, total / rounds / iterations * 1e9);
+    if (has_map)
+        printf("\"distinct_maps\": %d}\n", distinct);
+    else
+        printf("\"distinct_maps\": null}\n");
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* deep recursion with address-taken locals: the cost of frame poisoning */
+
+static int leaf(int* buf, int n) {
+    int local[4];
+    for (int i = 0; i < 4; i++)
+        local[i] = buf[i] + n;
+    return local[n & 3];
+}
+
+static int walk(int depth, int seed) {
+    int buf[8];
+    for (int i = 0; i < 8; i++)
+        buf[i] = seed + i;
+    if (depth == 0)
+        return leaf(buf, seed);
+    return walk(depth - 1, seed + 1) + leaf(buf, depth);
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? atoi(argv[1]) : 200000;
+    long sum = 0;
+
+    for (int r = 0; r < reps; r++)
+        sum += walk(32, r);
+
+    printf("%ld\n", sum);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* chained hash table with string keys: malloc/free churn and string functions */
+
+#define BUCKETS 4096
+#define KEYS 200000
+
+struct node {
+    char* key;
+    long value;
+    struct node* next;
+};
+
+static struct node* table[BUCKETS];
+
+static unsigned hash(const char* s) {
+    unsigned h = 5381;
+    while (*s)
+        h = h * 33 + (unsigned char) *s++;
+    return h % BUCKETS;
+}
+
+static void put(const char* key, long value) {
+    unsigned h = hash(key);
+    for (struct node* n = table[h]; n; n = n->next) {
+        if (!strcmp(n->key, key)) {
+            n->value += value;
+            return;
+        }
+    }
+    struct node* n = malloc(sizeof(struct node));
+    n->key = malloc(strlen(key) + 1);
+    strcpy(n->key, key);
+    n->value = value;
+    n->next = table[h];
+    table[h] = n;
+}
+
+static void clear() {
+    for (int i = 0; i < BUCKETS; i++) {
+        struct node* n = table[i];
+        while (n) {
+            struct node* next = n->next;
+            free(n->key);
+            free(n);
+            n = next;
+        }
+        table[i] = NULL;
+    }
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? atoi(argv[1]) : 5;
+    char key[32];
+    long sum = 0;
+
+    for (int r = 0; r < reps; r++) {
+        for (int i = 0; i < KEYS; i++) {
+            snprintf(key, sizeof(key), "key-%d", (i * 7919) % (KEYS / 2));
+            put(key, i);
+        }
+        for (int i = 0; i < BUCKETS; i++)
+            for (struct node* n = table[i]; n; n = n->next)
+                sum += n->value;
+        clear();
+    }
+
+    printf("%ld\n", sum);
+    return 0;
+}
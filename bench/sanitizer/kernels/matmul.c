@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* dense loads and stores on heap arrays, indexes unknown at compile time */
+
+#define N 256
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? atoi(argv[1]) : 20;
+    double* a = malloc(N * N * sizeof(double));
+    double* b = malloc(N * N * sizeof(double));
+    double* c = malloc(N * N * sizeof(double));
+    double sum = 0;
+
+    for (int i = 0; i < N * N; i++) {
+        a[i] = i % 7;
+        b[i] = i % 5;
+    }
+
+    for (int r = 0; r < reps; r++) {
+        for (int i = 0; i < N; i++)
+            for (int j = 0; j < N; j++) {
+                double acc = 0;
+                for (int k = 0; k < N; k++)
+                    acc += a[i * N + k] * b[k * N + j];
+                c[i * N + j] = acc;
+            }
+        sum += c[r % (N * N)];
+    }
+
+    printf("%f\n", sum);
+    free(a);
+    free(b);
+    free(c);
+    return 0;
+}
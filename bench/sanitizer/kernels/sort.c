@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* recursive quicksort: call heavy, every frame has a small local array */
+
+#define N 1000000
+
+static void insertion(int* v, int n) {
+    for (int i = 1; i < n; i++) {
+        int x = v[i], j = i - 1;
+        while (j >= 0 && v[j] > x) {
+            v[j + 1] = v[j];
+            j--;
+        }
+        v[j + 1] = x;
+    }
+}
+
+static void quicksort(int* v, int n) {
+    int samples[3];
+
+    if (n < 16) {
+        insertion(v, n);
+        return;
+    }
+
+    samples[0] = v[0];
+    samples[1] = v[n / 2];
+    samples[2] = v[n - 1];
+    insertion(samples, 3);
+    int pivot = samples[1];
+
+    int i = 0, j = n - 1;
+    while (i <= j) {
+        while (v[i] < pivot) i++;
+        while (v[j] > pivot) j--;
+        if (i <= j) {
+            int t = v[i];
+            v[i++] = v[j];
+            v[j--] = t;
+        }
+    }
+    quicksort(v, j + 1);
+    quicksort(v + i, n - i);
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? atoi(argv[1]) : 5;
+    int* v = malloc(N * sizeof(int));
+    unsigned seed = 1;
+    long sum = 0;
+
+    for (int r = 0; r < reps; r++) {
+        for (int i = 0; i < N; i++) {
+            seed = seed * 1103515245 + 12345;
+            v[i] = seed >> 8;
+        }
+        quicksort(v, N);
+        sum += v[N / 2];
+    }
+
+    printf("%ld\n", sum);
+    free(v);
+    return 0;
+}
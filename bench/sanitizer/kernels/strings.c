@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* memcpy, memset, memcmp and strlen on buffers of mixed sizes */
+
+#define BUF 65536
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? atoi(argv[1]) : 200;
+    char* src = malloc(BUF);
+    char* dst = malloc(BUF);
+    long sum = 0;
+
+    memset(src, 'a', BUF - 1);
+    src[BUF - 1] = 0;
+
+    for (int r = 0; r < reps; r++) {
+        for (size_t len = 1; len < BUF; len = len * 3 + 1) {
+            memcpy(dst, src, len);
+            dst[len - 1] = 0;
+            sum += strlen(dst);
+            sum += memcmp(dst, src, len - 1);
+            memset(dst, 0, len);
+        }
+        for (int i = 0; i < 1000; i++) {
+            memmove(dst + 1, src, 512);
+            sum += dst[i % 512];
+        }
+    }
+
+    printf("%ld\n", sum);
+    free(src);
+    free(dst);
+    return 0;
+}
@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "learnsan.h"
+#include "allocator.h"
+
+/*
+ * Microbenchmarks of the LearnSanitizer runtime, linked against
+ * learnsan-rt.o. Every measurement is printed as one JSON document on
+ * stdout, run.py merges it with the end to end numbers.
+ *
+ *   poison        learnsan_poison + learnsan_unpoison of one region
+ *   allocator     __hook_malloc + __hook_free pairs per size distribution
+ *                 and thread count
+ *   checks        cost of one __hook_load/__hook_store on valid memory
+ */
+
+extern void* __hook_malloc(size_t size);
+extern void __hook_free(void* ptr);
+extern void __hook_load(long addr, unsigned long size);
+extern void __hook_store(long addr, unsigned long size);
+
+#define MAX_THREADS 16
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* small xorshift, the distributions must not depend on libc rand() */
+static inline uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+
+static void bench_poison(int first) {
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 65536, 1 << 20 };
+    char* region = aligned_alloc(64, 1 << 20);
+
+    printf("%s\"poison\": [", first ? "" : ", ");
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t size = sizes[i];
+        // about 1 GB of memory described per run
+        size_t iters = (1ULL << 30) / size;
+        if (iters > 1000000)
+            iters = 1000000;
+
+        double start = now();
+        for (size_t j = 0; j < iters; j++) {
+            learnsan_poison(region, size, ASAN_HEAP_FREED);
+            learnsan_unpoison(region, size);
+        }
+        double elapsed = now() - start;
+
+        printf("%s{\"size\": %zu, \"ns_per_op\": %.2f, \"gb_per_s\": %.3f}", i ? ", " : "", size,
+               elapsed * 1e9 / iters, 2.0 * size * iters / elapsed / 1e9);
+    }
+    printf("]");
+    free(region);
+}
+
+
+struct distribution {
+    const char* name;
+    size_t min, max;
+};
+
+static const struct distribution distributions[] = {
+    { "fixed16", 16, 16 },
+    { "small", 1, 256 },
+    { "mixed", 1, 4096 },
+    { "large", 65536, 262144 },
+};
+
+struct alloc_job {
+    const struct distribution* dist;
+    size_t iters;
+    uint32_t seed;
+};
+
+#define LIVE_SLOTS 64
+
+static void* alloc_worker(void* arg) {
+    struct alloc_job* job = arg;
+    void* live[LIVE_SLOTS] = { 0 };
+    uint32_t state = job->seed;
+    size_t span = job->dist->max - job->dist->min + 1;
+
+    // a sliding window of live chunks, so that frees don't always hit the
+    // chunk that was just allocated
+    for (size_t i = 0; i < job->iters; i++) {
+        uint32_t r = next_random(&state);
+        unsigned slot = r % LIVE_SLOTS;
+        __hook_free(live[slot]);
+        live[slot] = __hook_malloc(job->dist->min + (r >> 8) % span);
+        *(volatile char*) live[slot] = 1;
+    }
+    for (unsigned i = 0; i < LIVE_SLOTS; i++)
+        __hook_free(live[i]);
+    return NULL;
+}
+
+static void bench_allocator() {
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    int first = 1;
+
+    printf(", \"allocator\": [");
+    for (unsigned d = 0; d < sizeof(distributions) / sizeof(distributions[0]); d++) {
+        for (unsigned t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+            int threads = thread_counts[t];
+            pthread_t tids[MAX_THREADS];
+            struct alloc_job jobs[MAX_THREADS];
+            size_t iters = distributions[d].max > 4096 ? 20000 : 500000;
+
+            double start = now();
+            for (int i = 0; i < threads; i++) {
+                jobs[i].dist = &distributions[d];
+                jobs[i].iters = iters;
+                jobs[i].seed = 0x9e3779b9 * (i + 1);
+                pthread_create(&tids[i], NULL, alloc_worker, &jobs[i]);
+            }
+            for (int i = 0; i < threads; i++)
+                pthread_join(tids[i], NULL);
+            double elapsed = now() - start;
+
+            printf("%s{\"distribution\": \"%s\", \"threads\": %d, \"ns_per_pair\": %.2f, "
+                   "\"mpairs_per_s\": %.3f}", first ? "" : ", ", distributions[d].name, threads,
+                   elapsed * 1e9 / (threads * iters), threads * iters / elapsed / 1e6);
+            first = 0;
+        }
+    }
+    printf("]");
+}
+
+
+#define CHECK_BUFFER 4096
+#define CHECK_ITERS (1 << 26)
+
+static void bench_checks() {
+    static const unsigned sizes[] = { 1, 2, 4, 8 };
+    char* buf = __hook_malloc(CHECK_BUFFER);
+    volatile long sink = 0;
+
+    // the same walk without the checks, subtracted from the checked ones
+    double start = now();
+    for (long i = 0; i < CHECK_ITERS; i++)
+        sink += (long)(buf + (i & (CHECK_BUFFER - 8)));
+    double base = now() - start;
+
+    printf(", \"checks\": {\"baseline_ns\": %.3f, \"load\": [", base * 1e9 / CHECK_ITERS);
+    for (unsigned k = 0; k < 2; k++) {
+        if (k)
+            printf("], \"store\": [");
+        for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            start = now();
+            for (long i = 0; i < CHECK_ITERS; i++) {
+                long addr = (long)(buf + (i & (CHECK_BUFFER - 8)));
+                if (k)
+                    __hook_store(addr, sizes[s]);
+                else
+                    __hook_load(addr, sizes[s]);
+                sink += addr;
+            }
+            double elapsed = now() - start;
+            printf("%s{\"size\": %u, \"ns_per_check\": %.3f}", s ? ", " : "", sizes[s],
+                   (elapsed - base) * 1e9 / CHECK_ITERS);
+        }
+    }
+    printf("]}");
+    __hook_free(buf);
+}
+
+
+int main() {
+    printf("{\"shadow_scale\": %d, ", SHADOW_SCALE);
+    bench_poison(1);
+    bench_allocator();
+    bench_checks();
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+
+# Runs the LearnSanitizer benchmarks built by the Makefile and prints (or
+# writes) a single JSON document:
+#
+#   microbench   output of build/microbench, see microbench.c
+#   kernels      for each kernel and build: wall time of every run, median,
+#                peak RSS, and the overhead of the median over the plain build
+
+import argparse
+import json
+import os
+import platform
+import statistics
+import subprocess
+import sys
+import time
+
+KERNELS = ["matmul", "sort", "hashmap", "strings", "calls"]
+BUILDS = ["plain", "learnsan", "asan"]
+
+
+def run_once(argv, env):
+    start = time.monotonic()
+    proc = subprocess.Popen(argv, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, env=env)
+    _, status, usage = os.wait4(proc.pid, 0)
+    elapsed = time.monotonic() - start
+    proc.returncode = os.waitstatus_to_exitcode(status) if hasattr(os, "waitstatus_to_exitcode") else status
+    stderr = proc.stderr.read().decode(errors="replace")
+    proc.stderr.close()
+    return elapsed, usage.ru_maxrss, proc.returncode, stderr
+
+
+def bench_kernel(path, reps, env):
+    times, rss = [], 0
+    for _ in range(reps):
+        elapsed, maxrss, code, stderr = run_once([path], env)
+        if code != 0:
+            return {"error": "exit code %d" % code, "stderr": stderr[-2000:]}
+        times.append(elapsed)
+        rss = max(rss, maxrss)
+    return {
+        "times_s": times,
+        "median_s": statistics.median(times),
+        "min_s": min(times),
+        "max_rss_kb": rss,
+    }
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(["git", "rev-parse", "HEAD"], stderr=subprocess.DEVNULL,
+                                       cwd=os.path.dirname(os.path.abspath(__file__))).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--build-dir", default="build")
+    parser.add_argument("--reps", type=int, default=5, help="runs of every kernel build")
+    parser.add_argument("--out", help="write the JSON here instead of stdout")
+    parser.add_argument("--no-micro", action="store_true", help="skip the runtime microbenchmark")
+    args = parser.parse_args()
+
+    # the sanitizers must not hide a slowdown behind a report and an early exit
+    env = dict(os.environ)
+    env.setdefault("ASAN_OPTIONS", "detect_leaks=0")
+
+    result = {
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "git_revision": git_revision(),
+        "machine": platform.machine(),
+        "cpus": os.cpu_count(),
+        "reps": args.reps,
+    }
+
+    micro = os.path.join(args.build_dir, "microbench")
+    if not args.no_micro and os.path.isfile(micro):
+        out = subprocess.run([micro], stdout=subprocess.PIPE, env=env, check=True).stdout
+        result["microbench"] = json.loads(out)
+
+    kernels = {}
+    for kernel in KERNELS:
+        kernels[kernel] = {}
+        for build in BUILDS:
+            path = os.path.join(args.build_dir, "%s.%s" % (kernel, build))
+            if not os.path.isfile(path):
+                kernels[kernel][build] = {"error": "not built"}
+                continue
+            kernels[kernel][build] = bench_kernel(path, args.reps, env)
+
+        plain = kernels[kernel]["plain"].get("median_s")
+        for build in BUILDS:
+            median = kernels[kernel][build].get("median_s")
+            if plain and median:
+                kernels[kernel][build]["overhead"] = median / plain
+    result["kernels"] = kernels
+
+    text = json.dumps(result, indent=2)
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
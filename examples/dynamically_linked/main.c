@@ -0,0 +1,14 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "add.h"
+
+int main(int argc, char** argv)
+{
+  int a = argc > 1 ? atoi(argv[1]) : 0;
+  int b = argc > 2 ? atoi(argv[2]) : 0;
+
+  if (add(a, b) == 42)
+    printf("the answer\n");
+  return 0;
+}
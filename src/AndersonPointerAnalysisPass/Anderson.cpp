@@ -5,15 +5,16 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 
-#include "NodeFactory.h"
-#include "Utils.h"
-#include "Solver.h"
+#include "Anderson.h"
+#ifdef SECURITY_PLUGIN
+#include "Plugin.h"
+#endif
 
 //#define DEBUG 1
 
@@ -26,8 +27,37 @@
 #define DEBUG(X) ((void)0)
 #endif
 
+// When the analysis is linked into another plugin (-DANDERSON_EMBEDDED) it
+// only serves queries, it is neither scheduled on its own nor printed. In the
+// new pass manager plugin (-DSECURITY_PLUGIN) only the "anderson" pass prints.
+#if defined(ANDERSON_EMBEDDED) || defined(SECURITY_PLUGIN)
+#define DUMP_RESULTS 0
+#else
+#define DUMP_RESULTS 1
+#endif
+
 using namespace llvm;
 
+static bool isHeapAllocator(StringRef Name) {
+
+    static const char *Allocators[] = {
+
+        "malloc", "calloc", "realloc", "aligned_alloc", "memalign", "valloc",
+        "pvalloc", "strdup", "strndup", "_Znwm", "_Znam", "_ZnwmRKSt9nothrow_t",
+        "_ZnamRKSt9nothrow_t", "_ZnwmSt11align_val_t", "_ZnamSt11align_val_t"
+
+    };
+
+    for (auto const &Allocator : Allocators) {
+
+      if (Name == Allocator) return true;
+
+    }
+
+    return false;
+
+}
+
 static std::string getValueName (const Value *v) {
   // If we can get name directly
   if (v->getName().str().length() > 0) {
@@ -59,177 +89,290 @@ static std::string getValueName (const Value *v) {
   }
 }
 
-struct AndersonAnalysisModulePass : public ModulePass {
-  private:
-    void AddFunctionReturnNodes(Module &M) {
-        for (Function &F: M) {
-            if (F.isIntrinsic() || F.isDeclaration())
-                continue;
-            if (F.getType()->isPointerTy()) {
-                Value* Ret = static_cast<Value*>(&F);
-                NF.createRetNode(Ret);
-            }
+void AndersonAnalysisModulePass::AddGlobalNodes(Module &M) {
+    for (GlobalVariable &GV : M.globals()) {
+        int srcIdx = NF.createAllocSiteNode(&GV);
+        int destIdx = NF.createPointerNode(&GV);
+        AllConstraints.emplace_back(destIdx, srcIdx, AddressOf);
+
+        // the initializer and other modules may store any pointer in it
+        if (!GV.hasLocalLinkage() || !GV.hasInitializer() ||
+            !GV.getInitializer()->isNullValue())
+            UnknownNodes.push_back(srcIdx);
+    }
+}
+
+void AndersonAnalysisModulePass::AddFunctionReturnNodes(Module &M) {
+    for (Function &F: M) {
+        if (F.isIntrinsic() || F.isDeclaration())
+            continue;
+        if (F.getReturnType()->isPointerTy()) {
+            Value* Ret = static_cast<Value*>(&F);
+            NF.createRetNode(Ret);
         }
     }
+}
 
-    void AddFunctionBodyConstraints(Module &M) {
+void AndersonAnalysisModulePass::AddFunctionBodyConstraints(Module &M) {
 
-        for (Function &F : M) {
-            for (BasicBlock &BB : F) {
-                for (Instruction &I : BB) {
-                    if (I.getType() && I.getType()->isPointerTy()) {
-                        NF.createPointerNode(&I);
-                    }
-                }
-            }
-            for (BasicBlock &BB : F) {
-                for (Instruction &I : BB) {
-                    AddInstructionConstraints(I);
+    for (Function &F : M) {
+        // callers we don't see may pass anything
+        bool externallyCallable = !F.hasLocalLinkage() || F.hasAddressTaken();
+        for (Argument &A : F.args()) {
+            if (!A.getType()->isPointerTy())
+                continue;
+            int idx = NF.createPointerNode(&A);
+            if (externallyCallable)
+                UnknownNodes.push_back(idx);
+        }
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                if (I.getType() && I.getType()->isPointerTy()) {
+                    NF.createPointerNode(&I);
                 }
             }
-        }     
+        }
     }
 
-    void AddInstructionConstraints(Instruction &I) {
-        if (isa<AllocaInst>(&I)) {
-            if(!I.getType()->isPointerTy())
-                return;
-            int srcIdx = NF.createAllocSiteNode(&I);
-            int destIdx = NF.getPointerNode(&I);
-            AllConstraints.emplace_back(destIdx, srcIdx, AddressOf); 
-        }
-        else if (isa<LoadInst>(&I)) {
-            if (!I.getType()->isPointerTy())
-                return;
-            int srcIdx = NF.getPointerNode(I.getOperand(0));
-            int destIdx = NF.getPointerNode(&I);
-            AllConstraints.emplace_back(destIdx, srcIdx, Load);
-        }
-        else if (isa<StoreInst>(&I)) {
-            if(I.getOperand(0)->getType()->isPointerTy()) {
-                int srcIdx = NF.getPointerNode(I.getOperand(0));
-                int destIdx = NF.getPointerNode(I.getOperand(1));
-                AllConstraints.emplace_back(destIdx, srcIdx, Store);
-            }
-        }
-        else if (isa<PHINode>(&I)) {
-            if (!I.getType()->isPointerTy())
-                return;
-            PHINode* phi = static_cast<PHINode*>(&I);
-            int destIdx = NF.getPointerNode(&I);
-            for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
-                int srcIdx = NF.getPointerNode(phi->getIncomingValue(i));
-                AllConstraints.emplace_back(destIdx, srcIdx, Copy);
+    for (Function &F : M) {
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                AddInstructionConstraints(I);
             }
         }
-        else if (isa<CallInst>(&I) || isa<InvokeInst>(&I)) {
-            CallBase* CB = static_cast<CallBase*>(&I);
-            if (CB->isIndirectCall())
-                return;
-            Function* calledFunction = CB->getCalledFunction();
-            if (calledFunction->isIntrinsic() || calledFunction->isDeclaration())
-                return;
-
-            if (!CB->getFunctionType()->isPointerTy())
-                return;
-
-            int destIdx = NF.getPointerNode(&I);
-            int srcIdx;
-            if (calledFunction->getName().compare("malloc")) {
-                // Naive way to check if it is a malloc and also
-                // we should extend to calloc, realloc, handle the free, ..
-                srcIdx = NF.getAllocSiteNode(&I);
-                AllConstraints.emplace_back(destIdx, srcIdx, AddressOf);
-            }
-            else {
-                srcIdx = NF.getRetNode(calledFunction);
-                AllConstraints.emplace_back(destIdx, srcIdx, Copy);
-            }
+    }     
+}
 
+// Node of an operand: constants are looked through, anything the analysis
+// doesn't model gets a node with an unknown points-to set.
+int AndersonAnalysisModulePass::getNode(Value* V) {
+    if (isa<Constant>(V))
+        V = V->stripPointerCasts();
+    if (NF.hasPointerNode(V))
+        return NF.getPointerNode(V);
+    if (isa<ConstantPointerNull>(V) || isa<UndefValue>(V))
+        return NF.createPointerNode(V);
+    return createUnknownNode(V);
+}
 
-            AddArgConstraints(CB, calledFunction);
+int AndersonAnalysisModulePass::createUnknownNode(Value* V) {
+    int idx = NF.hasPointerNode(V) ? NF.getPointerNode(V) : NF.createPointerNode(V);
+    UnknownNodes.push_back(idx);
+    return idx;
+}
 
+void AndersonAnalysisModulePass::AddInstructionConstraints(Instruction &I) {
+    if (isa<AllocaInst>(&I)) {
+        if(!I.getType()->isPointerTy())
+            return;
+        int srcIdx = NF.createAllocSiteNode(&I);
+        int destIdx = NF.getPointerNode(&I);
+        AllConstraints.emplace_back(destIdx, srcIdx, AddressOf); 
+    }
+    else if (isa<LoadInst>(&I)) {
+        if (!I.getType()->isPointerTy())
+            return;
+        int srcIdx = getNode(I.getOperand(0));
+        int destIdx = NF.getPointerNode(&I);
+        AllConstraints.emplace_back(destIdx, srcIdx, Load);
+    }
+    else if (StoreInst* SI = dyn_cast<StoreInst>(&I)) {
+        if(I.getOperand(0)->getType()->isPointerTy()) {
+            int srcIdx = getNode(I.getOperand(0));
+            int destIdx = getNode(I.getOperand(1));
+            AllConstraints.emplace_back(destIdx, srcIdx, Store);
+        }
+        else if (I.getModule()->getDataLayout().getTypeStoreSize(SI->getValueOperand()->getType()) >= 8) {
+            // integers, vectors and aggregates wide enough to carry a pointer
+            EscapedPointers.push_back(getNode(SI->getPointerOperand()));
+        }
+    }
+    else if (isa<PHINode>(&I)) {
+        if (!I.getType()->isPointerTy())
+            return;
+        PHINode* phi = static_cast<PHINode*>(&I);
+        int destIdx = NF.getPointerNode(&I);
+        for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+            int srcIdx = getNode(phi->getIncomingValue(i));
+            AllConstraints.emplace_back(destIdx, srcIdx, Copy);
+        }
+    }
+    else if (isa<SelectInst>(&I)) {
+        if (!I.getType()->isPointerTy())
+            return;
+        int destIdx = NF.getPointerNode(&I);
+        AllConstraints.emplace_back(destIdx, getNode(I.getOperand(1)), Copy);
+        AllConstraints.emplace_back(destIdx, getNode(I.getOperand(2)), Copy);
+    }
+    else if (isa<BitCastInst>(&I) || isa<AddrSpaceCastInst>(&I)) {
+        if (!I.getType()->isPointerTy() || !I.getOperand(0)->getType()->isPointerTy())
+            return;
+        int destIdx = NF.getPointerNode(&I);
+        int srcIdx = getNode(I.getOperand(0));
+        AllConstraints.emplace_back(destIdx, srcIdx, Copy);
+    }
+    else if (isa<CallInst>(&I) || isa<InvokeInst>(&I)) {
+        CallBase* CB = static_cast<CallBase*>(&I);
+        Function* calledFunction = CB->getCalledFunction();
+
+        if (calledFunction && calledFunction->isIntrinsic()) {
+            // memcpy and friends move pointers between objects behind our back
+            if (MemTransferInst* MT = dyn_cast<MemTransferInst>(&I))
+                EscapedPointers.push_back(getNode(MT->getRawDest()));
+            if (I.getType()->isPointerTy())
+                createUnknownNode(&I);
+            return;
         }
-        else if (isa<ReturnInst>(&I)) {
-            if (I.getNumOperands() > 0 && I.getOperand(0)->getType()->isPointerTy()) {
 
-                int destIdx = NF.getRetNode(I.getParent()->getParent());
-                int srcIdx = NF.getPointerNode(I.getOperand(0));
-                AllConstraints.emplace_back(destIdx, srcIdx, Copy);
+        if (!calledFunction || calledFunction->isDeclaration()) {
+            if (I.getType()->isPointerTy()) {
+                if (calledFunction && isHeapAllocator(calledFunction->getName())) {
+                    int srcIdx = NF.createAllocSiteNode(&I);
+                    AllConstraints.emplace_back(NF.getPointerNode(&I), srcIdx, AddressOf);
+                }
+                else
+                    createUnknownNode(&I);
             }
+            AddEscapeConstraints(CB);
+            return;
         }
-        else if (isa<GetElementPtrInst>(&I)) {
+
+        if (CB->getType()->isPointerTy()) {
             int destIdx = NF.getPointerNode(&I);
-            int srcIdx = NF.getPointerNode(I.getOperand(0));
+            int srcIdx = NF.getRetNode(calledFunction);
             AllConstraints.emplace_back(destIdx, srcIdx, Copy);
         }
-        else
-            return;
+
+        AddArgConstraints(CB, calledFunction);
 
     }
+    else if (isa<ReturnInst>(&I)) {
+        if (I.getNumOperands() > 0 && I.getOperand(0)->getType()->isPointerTy()) {
 
-    void AddArgConstraints(CallBase* CB, Function* F) {
-        auto argumentIterator = CB->arg_begin();
-        auto parameterIterator = F->arg_begin();
-        
-        while (argumentIterator != CB->arg_end() && parameterIterator != F->arg_end()) {
-            Value* argument = *argumentIterator;
-            Value* parameter = &*parameterIterator;
-            if (argument->getType()->isPointerTy() && parameter->getType()->isPointerTy()) {
-                int destIdx = NF.getPointerNode(parameter);
-                int srcIdx = NF.getPointerNode(argument);
-                AllConstraints.emplace_back(destIdx, srcIdx, Copy);
-            }
-            argumentIterator++;
-            parameterIterator++;
+            int destIdx = NF.getRetNode(I.getParent()->getParent());
+            int srcIdx = getNode(I.getOperand(0));
+            AllConstraints.emplace_back(destIdx, srcIdx, Copy);
         }
     }
+    else if (GetElementPtrInst* GEP = dyn_cast<GetElementPtrInst>(&I)) {
+        int destIdx = NF.getPointerNode(&I);
+        int srcIdx = getNode(I.getOperand(0));
+        AllConstraints.emplace_back(destIdx, srcIdx, Copy);
+        // may point inside the object, sizes can't be trusted anymore
+        if (!GEP->hasAllZeroIndices())
+            UnknownNodes.push_back(destIdx);
+    }
+    else if (isa<AtomicRMWInst>(&I) || isa<AtomicCmpXchgInst>(&I)) {
+        EscapedPointers.push_back(getNode(I.getOperand(0)));
+        if (I.getType()->isPointerTy())
+            createUnknownNode(&I);
+    }
+    else if (PtrToIntInst* PI = dyn_cast<PtrToIntInst>(&I)) {
+        // the pointees can now be reached through integers
+        EscapedPointers.push_back(getNode(PI->getPointerOperand()));
+    }
+    else if (I.getType()->isPointerTy())
+        createUnknownNode(&I);
+
+}
 
-    void dumpConstraints() {
-      errs() << "Constraints " << AllConstraints.size() << "\n";
-      for(auto &item: AllConstraints) {
-        auto srcStr = getValueName(NF.getValueByIdx(item.src));
-        auto destStr = getValueName(NF.getValueByIdx(item.dest));
-        // auto srcStr = item.getSrc();
-        // auto destStr = item.getDest();
-        switch(item.type) {
-          case AddressOf:
-            errs() << destStr << " <- &" << srcStr << "\n";
-            break;
-          case Copy:
-            errs() << destStr << " <- " << srcStr << "\n";
-            break;
-          case Load:
-            errs() << destStr << " <- *" << srcStr << "\n";
-            break;
-          case Store:
-            errs() << "*" << destStr << " <- " << srcStr << "\n";
-            break;
+void AndersonAnalysisModulePass::AddArgConstraints(CallBase* CB, Function* F) {
+    auto argumentIterator = CB->arg_begin();
+    auto parameterIterator = F->arg_begin();
+    
+    while (argumentIterator != CB->arg_end() && parameterIterator != F->arg_end()) {
+        Value* argument = *argumentIterator;
+        Value* parameter = &*parameterIterator;
+        if (argument->getType()->isPointerTy() && parameter->getType()->isPointerTy()) {
+            int destIdx = NF.getPointerNode(parameter);
+            int srcIdx = getNode(argument);
+            AllConstraints.emplace_back(destIdx, srcIdx, Copy);
         }
-      }
+        argumentIterator++;
+        parameterIterator++;
     }
 
+    // variadic arguments are read back with va_arg, which we don't model
+    for (; argumentIterator != CB->arg_end(); argumentIterator++) {
+        if ((*argumentIterator)->getType()->isPointerTy())
+            EscapedPointers.push_back(getNode(*argumentIterator));
+    }
+}
 
-  public:
-    
-  NodeFactory NF;
-  vector<MyConstraint> AllConstraints; 
+// Pointers handed to code we can't see: whatever they point to may be
+// overwritten with arbitrary pointers.
+void AndersonAnalysisModulePass::AddEscapeConstraints(CallBase* CB) {
+    for (Value* argument : CB->args()) {
+        if (argument->getType()->isPointerTy())
+            EscapedPointers.push_back(getNode(argument));
+    }
+}
+
+void AndersonAnalysisModulePass::computeImprecise(Module &M) {
+    vector<PointsToNode>& nodes = Graph->getGraph();
+    Imprecise.assign(nodes.size(), false);
 
-  static char ID;
-  //Hello() : ModulePass(ID) {}
-  explicit AndersonAnalysisModulePass() : ModulePass(ID) {}
+    for (int idx : UnknownNodes)
+        Imprecise[idx] = true;
 
+    // escaped objects, and everything reachable from their content
+    vector<bool> escaped(nodes.size(), false);
+    vector<int> pending;
+    for (int idx : EscapedPointers) {
+        for (int pointee : nodes[idx].getPtsSet())
+            pending.push_back(pointee);
+    }
+    while (!pending.empty()) {
+        int object = pending.back();
+        pending.pop_back();
+        if (escaped[object])
+            continue;
+        escaped[object] = true;
+        Imprecise[object] = true;
+        for (int pointee : nodes[object].getPtsSet())
+            pending.push_back(pointee);
+    }
 
-  void getAnalysisUsage(AnalysisUsage &AU) const override {
-    AU.addRequired<LoopInfoWrapperPass>();
+    Graph->markReachable(Imprecise);
+}
+
+void AndersonAnalysisModulePass::dumpConstraints() {
+  errs() << "Constraints " << AllConstraints.size() << "\n";
+  for(auto &item: AllConstraints) {
+    auto srcStr = getValueName(NF.getValueByIdx(item.src));
+    auto destStr = getValueName(NF.getValueByIdx(item.dest));
+    // auto srcStr = item.getSrc();
+    // auto destStr = item.getDest();
+    switch(item.type) {
+      case AddressOf:
+        errs() << destStr << " <- &" << srcStr << "\n";
+        break;
+      case Copy:
+        errs() << destStr << " <- " << srcStr << "\n";
+        break;
+      case Load:
+        errs() << destStr << " <- *" << srcStr << "\n";
+        break;
+      case Store:
+        errs() << "*" << destStr << " <- " << srcStr << "\n";
+        break;
+    }
   }
+}
+
+
+void AndersonAnalysisModulePass::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesAll();
+}
 
-  bool doInitialization(Module &M) override {
+bool AndersonAnalysisModulePass::doInitialization(Module &M) {
+  if (DUMP_RESULTS)
     errs() << "INITIALIZATION \n";
-    return true;
-  }
-  
-  bool runOnModule(Module &M) override {
+  return true;
+}
+
+bool AndersonAnalysisModulePass::runOnModule(Module &M) {
+    AddGlobalNodes(M);
     AddFunctionReturnNodes(M);
     AddFunctionBodyConstraints(M);
     
@@ -237,13 +380,21 @@ struct AndersonAnalysisModulePass : public ModulePass {
 
     DEBUG(dumpConstraints());
     
-    AndersonGraph anderson(n, AllConstraints);
-    anderson.solve();
+    Graph.reset(new AndersonGraph(n, AllConstraints));
+    Graph->solve();
+    computeImprecise(M);
 
-    //anderson.dumpGraph();
+    //Graph->dumpGraph();
+
+    if (DUMP_RESULTS)
+        dumpPointsToSets();
+
+    return false;
+}
 
+void AndersonAnalysisModulePass::dumpPointsToSets() {
     map<int, vector<int>> nodes_map;
-    anderson.graph2map(&nodes_map);
+    Graph->graph2map(&nodes_map);
 
     for (auto it = nodes_map.begin(); it != nodes_map.end(); ++it) {
         int idx = it->first;
@@ -255,13 +406,48 @@ struct AndersonAnalysisModulePass : public ModulePass {
             errs() << "\t" << getValueName(pointee) << "\n";
         }
     }
+}
 
-    return false;
-  }
-}; 
+bool AndersonAnalysisModulePass::getNonHeapObjects(const Value* V, vector<const Value*>& Objects) {
+    Value* Ptr = const_cast<Value*>(V);
+    if (!Graph || !NF.hasPointerNode(Ptr))
+        return false;
+
+    int idx = NF.getPointerNode(Ptr);
+    if (Imprecise[idx])
+        return false;
+
+    set<int>& pointees = Graph->getGraph()[idx].getPtsSet();
+    if (pointees.empty())
+        return false;
+
+    for (int p : pointees) {
+        const Value* Object = NF.getValueByIdx(p);
+        if (!isa<AllocaInst>(Object) && !isa<GlobalVariable>(Object))
+            return false;
+        Objects.push_back(Object);
+    }
+    return true;
+}
 
 char AndersonAnalysisModulePass::ID = 0;
 
+#ifdef SECURITY_PLUGIN
+AndersonAnalysis::Result AndersonAnalysis::run(Module &M, ModuleAnalysisManager &) {
+
+  Result Pass(new AndersonAnalysisModulePass());
+  Pass->runOnModule(M);
+  return Pass;
+
+}
+
+PreservedAnalyses AndersonPrinterPass::run(Module &M, ModuleAnalysisManager &MAM) {
+
+  MAM.getResult<AndersonAnalysis>(M)->dumpPointsToSets();
+  return PreservedAnalyses::all();
+
+}
+#elif !defined(ANDERSON_EMBEDDED)
 static void registerAndersonAnalysisPass(const PassManagerBuilder &,
                                legacy::PassManagerBase &PM) {
 
@@ -280,3 +466,10 @@ static RegisterPass<AndersonAnalysisModulePass>
       false,
       false
     );
+#else
+static RegisterPass<AndersonAnalysisModulePass>
+    X("learnsan-anderson", "AndrersonAnalysisPass for LearnSanitizer",
+      false,
+      true
+    );
+#endif
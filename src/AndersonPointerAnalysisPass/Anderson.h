@@ -0,0 +1,70 @@
+#ifndef ANDERSON_H
+#define ANDERSON_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+#include <memory>
+#include <vector>
+
+#include "NodeFactory.h"
+#include "Utils.h"
+#include "Solver.h"
+
+using namespace llvm;
+
+/*
+ * Inclusion based (Andersen style) points-to analysis.
+ *
+ * Besides being runnable on its own, the pass can be required by other
+ * passes, which query the solved points-to sets through getNonHeapObjects().
+ * A points-to set is only reported when it is complete: pointers that may come
+ * from code the analysis doesn't see (external functions, integer casts,
+ * memory escaped to external calls) or that may point inside an object
+ * (non-zero GEPs) are marked imprecise after solving.
+ */
+struct AndersonAnalysisModulePass : public ModulePass {
+  private:
+    std::unique_ptr<AndersonGraph> Graph;
+
+    // nodes whose points-to set is incomplete or may be an interior pointer
+    vector<bool> Imprecise;
+    vector<int> UnknownNodes;
+    vector<int> EscapedPointers;
+
+    void AddGlobalNodes(Module &M);
+    void AddFunctionReturnNodes(Module &M);
+    void AddFunctionBodyConstraints(Module &M);
+    void AddInstructionConstraints(Instruction &I);
+    void AddArgConstraints(CallBase* CB, Function* F);
+    void AddEscapeConstraints(CallBase* CB);
+    int getNode(Value* V);
+    int createUnknownNode(Value* V);
+    void computeImprecise(Module &M);
+    void dumpConstraints();
+
+  public:
+
+  NodeFactory NF;
+  vector<MyConstraint> AllConstraints;
+
+  static char ID;
+  //Hello() : ModulePass(ID) {}
+  explicit AndersonAnalysisModulePass() : ModulePass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override;
+  bool doInitialization(Module &M) override;
+  bool runOnModule(Module &M) override;
+
+  // prints the points-to set of every pointer
+  void dumpPointsToSets();
+
+  // Fills Objects with the allocas and globals that V may point to, and
+  // returns true, only if the set is complete, non empty, holds no heap
+  // allocation site and V points to the beginning of each of them.
+  bool getNonHeapObjects(const Value* V, vector<const Value*>& Objects);
+};
+
+#endif
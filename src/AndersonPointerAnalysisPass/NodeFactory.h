@@ -1,3 +1,6 @@
+#ifndef NODE_FACTORY_H
+#define NODE_FACTORY_H
+
 #include <llvm/IR/Value.h>
 #include <llvm/Support/raw_ostream.h>
 
@@ -38,6 +41,15 @@ class NodeFactory {
         unsigned getAllocSiteNode(Value* V);
         unsigned getPointerNode(Value* V);
         unsigned getRetNode(Value* V);
+        bool hasPointerNode(Value* V) {
+            return pointerNodes.count(V);
+        }
+        bool hasAllocSiteNode(Value* V) {
+            return allocSiteNodes.count(V);
+        }
+        bool hasRetNode(Value* V) {
+            return retNodes.count(V);
+        }
         unsigned getNumNode() {
             return nodes.size();
         };
@@ -46,3 +58,5 @@ class NodeFactory {
         }
         
 };
+
+#endif
@@ -103,3 +103,24 @@ void AndersonGraph::graph2map(map<int, vector<int>>* res) {
     }
 
 }
+
+// Extends marked to every node reachable from a marked node through the
+// solved copy edges, i.e. every node that a marked value may flow into.
+void AndersonGraph::markReachable(vector<bool>& marked) {
+    queue<int> pending;
+    for (unsigned idx = 0; idx < marked.size(); idx++) {
+        if (marked[idx])
+            pending.push(idx);
+    }
+
+    while (!pending.empty()) {
+        int idx = pending.front();
+        pending.pop();
+        for (int successor : graph[idx].getSuccessors()) {
+            if (!marked[successor]) {
+                marked[successor] = true;
+                pending.push(successor);
+            }
+        }
+    }
+}
@@ -1,3 +1,6 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
 #include "Utils.h"
 
 
@@ -81,8 +84,7 @@ class AndersonGraph {
         vector<PointsToNode>& getGraph();
         void dumpGraph();
         void graph2map(map<int, vector<int>>* res);
+        void markReachable(vector<bool>& marked);
 };
 
-
-
-
+#endif
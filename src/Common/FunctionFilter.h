@@ -0,0 +1,232 @@
+#ifndef FUNCTION_FILTER_H
+#define FUNCTION_FILTER_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SpecialCaseList.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * The functions a pass instruments, beyond the runtime functions it always
+ * leaves alone. Read from the environment, with the prefix of the pass:
+ *
+ *   <P>_ALLOWLIST    only the functions matched by this special case list
+ *   <P>_DENYLIST     never the functions matched by this one
+ *   <P>_PROFILE      an indexed llvm-profdata profile, whose hottest functions
+ *   <P>_PROFILE_HOT  percent, 10 by default, are left out
+ *   <P>_DIFF         a unified diff, only the functions with changed lines
+ *
+ * The lists take the clang sanitizer format, fun:<glob> and src:<glob>
+ * entries, optionally in a [section] named after the pass. The diff needs
+ * debug info to map the changed lines to functions.
+ *
+ * The decision is taken once per function by select(), the passes then only
+ * look the function up.
+ */
+class FunctionFilter {
+    const char* PassName;
+    std::string EnvPrefix, Section;
+
+    std::unique_ptr<llvm::SpecialCaseList> Allow, Deny;
+
+    bool HasProfile = false;
+    llvm::StringSet<> HotFunctions;
+
+    // changed line ranges of the new side of the diff, by file
+    bool HasDiff = false;
+    llvm::StringMap<std::vector<std::pair<unsigned, unsigned>>> ChangedLines;
+
+    llvm::DenseSet<const llvm::Function*> Selected;
+
+    const char* getEnv(const char* Name) const {
+        return getenv((EnvPrefix + "_" + Name).c_str());
+    }
+
+    [[noreturn]] void fail(const llvm::Twine& Message) const {
+        llvm::report_fatal_error(llvm::Twine(PassName) + ": " + Message);
+    }
+
+    std::unique_ptr<llvm::SpecialCaseList> loadList(const char* Name) {
+        const char* Path = getEnv(Name);
+        if (!Path)
+            return nullptr;
+        std::string Error;
+        auto List = llvm::SpecialCaseList::create({Path}, *llvm::vfs::getRealFileSystem(), Error);
+        if (!List)
+            fail(EnvPrefix + "_" + Name + ": " + Error);
+        return List;
+    }
+
+    // the functions are ranked by the sum of their counters
+    void loadProfile(const char* Path) {
+        unsigned HotPercent = 10;
+        if (const char* Hot = getEnv("PROFILE_HOT")) {
+            if (llvm::StringRef(Hot).getAsInteger(10, HotPercent) || HotPercent > 100)
+                fail(EnvPrefix + "_PROFILE_HOT must be a percentage");
+        }
+
+        auto ReaderOrErr = llvm::IndexedInstrProfReader::create(Path);
+        if (llvm::Error E = ReaderOrErr.takeError())
+            fail(llvm::Twine(Path) + ": " + llvm::toString(std::move(E)));
+        auto Reader = std::move(ReaderOrErr.get());
+
+        llvm::StringMap<uint64_t> Counts;
+        for (const llvm::NamedInstrProfRecord& Record : *Reader) {
+            uint64_t& Count = Counts[Record.Name];
+            for (uint64_t C : Record.Counts)
+                Count = llvm::SaturatingAdd(Count, C);
+        }
+        if (Reader->hasError())
+            fail(llvm::Twine(Path) + ": " + llvm::toString(Reader->getError()));
+
+        std::vector<std::pair<uint64_t, llvm::StringRef>> Ranked;
+        for (auto& Entry : Counts) {
+            if (Entry.getValue())
+                Ranked.push_back({Entry.getValue(), Entry.getKey()});
+        }
+        std::sort(Ranked.begin(), Ranked.end(), [](const std::pair<uint64_t, llvm::StringRef>& A,
+                                                   const std::pair<uint64_t, llvm::StringRef>& B) {
+            return A.first > B.first;
+        });
+        size_t Hot = (Ranked.size() * HotPercent + 99) / 100;
+        for (size_t i = 0; i < Hot; i++)
+            HotFunctions.insert(Ranked[i].second);
+        HasProfile = true;
+    }
+
+    void loadDiff(const char* Path) {
+        auto Buffer = llvm::MemoryBuffer::getFile(Path);
+        if (!Buffer)
+            fail(llvm::Twine(Path) + ": " + Buffer.getError().message());
+
+        llvm::SmallVector<llvm::StringRef, 0> Lines;
+        (*Buffer)->getBuffer().split(Lines, '\n');
+        std::vector<std::pair<unsigned, unsigned>>* Ranges = nullptr;
+        for (llvm::StringRef Line : Lines) {
+            if (Line.consume_front("+++ ")) {
+                Line = Line.split('\t').first.rtrim();
+                Line.consume_front("b/");
+                Ranges = Line == "/dev/null" ? nullptr : &ChangedLines[Line];
+            }
+            else if (Ranges && Line.consume_front("@@ -")) {
+                // @@ -old[,count] +new[,count] @@
+                Line = Line.split(" +").second.split(' ').first;
+                unsigned Start = 0, Count = 1;
+                llvm::StringRef CountStr;
+                std::tie(Line, CountStr) = Line.split(',');
+                if (Line.getAsInteger(10, Start) || (!CountStr.empty() && CountStr.getAsInteger(10, Count)))
+                    fail(llvm::Twine(Path) + ": malformed hunk header");
+                // a deletion is blamed on the line after it
+                Ranges->push_back({Start, Start + std::max(Count, 1U) - 1});
+            }
+        }
+        HasDiff = true;
+    }
+
+    const std::vector<std::pair<unsigned, unsigned>>* getChangedLines(const llvm::DIFile* File) const {
+        std::string FilePath = File->getFilename().str();
+        if (!llvm::StringRef(FilePath).startswith("/") && !File->getDirectory().empty())
+            FilePath = (File->getDirectory() + "/" + FilePath).str();
+        for (auto& Entry : ChangedLines) {
+            llvm::StringRef DiffPath = Entry.getKey();
+            if (FilePath == DiffPath || llvm::StringRef(FilePath).endswith(("/" + DiffPath).str()))
+                return &Entry.getValue();
+        }
+        return nullptr;
+    }
+
+    bool isChanged(const llvm::Function& F,
+                   llvm::DenseMap<const llvm::DIFile*, const std::vector<std::pair<unsigned, unsigned>>*>& Files) const {
+        auto InRanges = [&](const llvm::DIFile* File, unsigned Line) {
+            if (!File)
+                return false;
+            auto It = Files.find(File);
+            if (It == Files.end())
+                It = Files.insert({File, getChangedLines(File)}).first;
+            if (!It->second)
+                return false;
+            for (auto& Range : *It->second) {
+                if (Line >= Range.first && Line <= Range.second)
+                    return true;
+            }
+            return false;
+        };
+
+        if (llvm::DISubprogram* SP = F.getSubprogram()) {
+            if (InRanges(SP->getFile(), SP->getLine()))
+                return true;
+        }
+        for (const llvm::Instruction& I : llvm::instructions(F)) {
+            if (const llvm::DILocation* Loc = I.getDebugLoc()) {
+                if (InRanges(Loc->getFile(), Loc->getLine()))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+  public:
+    FunctionFilter(const char* PassName, const char* EnvPrefix, const char* Section)
+        : PassName(PassName), EnvPrefix(EnvPrefix), Section(Section) {
+        Allow = loadList("ALLOWLIST");
+        Deny = loadList("DENYLIST");
+        if (const char* Profile = getEnv("PROFILE"))
+            loadProfile(Profile);
+        if (const char* Diff = getEnv("DIFF"))
+            loadDiff(Diff);
+    }
+
+    // Skip holds the functions the pass never instruments
+    void select(llvm::Module& M, llvm::function_ref<bool(const llvm::Function&)> Skip) {
+        Selected.clear();
+        llvm::StringRef Source = M.getSourceFileName();
+        bool SourceAllowed = Allow && Allow->inSection(Section, "src", Source);
+        bool SourceDenied = Deny && Deny->inSection(Section, "src", Source);
+
+        llvm::DenseMap<const llvm::DIFile*, const std::vector<std::pair<unsigned, unsigned>>*> Files;
+        size_t Candidates = 0;
+        for (llvm::Function& F : M) {
+            if (F.isDeclaration() || Skip(F))
+                continue;
+            Candidates++;
+            if (SourceDenied || (Deny && Deny->inSection(Section, "fun", F.getName())))
+                continue;
+            if (Allow && !SourceAllowed && !Allow->inSection(Section, "fun", F.getName()))
+                continue;
+            if (HasProfile && (HotFunctions.count(llvm::getPGOFuncName(F)) || HotFunctions.count(F.getName())))
+                continue;
+            if (HasDiff && !isChanged(F, Files))
+                continue;
+            Selected.insert(&F);
+        }
+
+        if ((Allow || Deny || HasProfile || HasDiff) && getEnv("STATS"))
+            llvm::errs() << PassName << ": " << M.getName() << ": " << Selected.size() << " of "
+                         << Candidates << " functions selected by the filters\n";
+    }
+
+    bool isSelected(const llvm::Function& F) const {
+        return Selected.count(&F);
+    }
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef INSTRUCTION_INDEX_H
+#define INSTRUCTION_INDEX_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+/*
+ * The instructions the passes look for, collected in a single walk over the
+ * module, in program order. Run alone, a pass builds its own index; in the
+ * plugin of src/Plugin the passes share the one cached by the analysis
+ * manager, until a pass erases some of its instructions.
+ */
+struct FunctionInstructions {
+    std::vector<llvm::LoadInst*> Loads;
+    std::vector<llvm::StoreInst*> Stores;
+    std::vector<llvm::MemIntrinsic*> MemIntrinsics;
+    // calls and invokes, intrinsics excluded
+    std::vector<llvm::CallBase*> Calls;
+    std::vector<llvm::ICmpInst*> Compares;
+    std::vector<llvm::SwitchInst*> Switches;
+    // ret and resume
+    std::vector<llvm::Instruction*> Exits;
+};
+
+class InstructionIndex {
+    llvm::DenseMap<const llvm::Function*, FunctionInstructions> Functions;
+    FunctionInstructions Empty;
+
+  public:
+    explicit InstructionIndex(llvm::Module& M) {
+        for (llvm::Function& F : M) {
+            if (F.isDeclaration())
+                continue;
+            FunctionInstructions& FI = Functions[&F];
+            for (llvm::BasicBlock& BB : F) {
+                for (llvm::Instruction& I : BB) {
+                    if (llvm::LoadInst* LI = llvm::dyn_cast<llvm::LoadInst>(&I))
+                        FI.Loads.push_back(LI);
+                    else if (llvm::StoreInst* SI = llvm::dyn_cast<llvm::StoreInst>(&I))
+                        FI.Stores.push_back(SI);
+                    else if (llvm::MemIntrinsic* MI = llvm::dyn_cast<llvm::MemIntrinsic>(&I))
+                        FI.MemIntrinsics.push_back(MI);
+                    else if (llvm::CallBase* CB = llvm::dyn_cast<llvm::CallBase>(&I)) {
+                        if (!llvm::isa<llvm::IntrinsicInst>(CB))
+                            FI.Calls.push_back(CB);
+                    }
+                    else if (llvm::ICmpInst* Cmp = llvm::dyn_cast<llvm::ICmpInst>(&I))
+                        FI.Compares.push_back(Cmp);
+                    else if (llvm::SwitchInst* Switch = llvm::dyn_cast<llvm::SwitchInst>(&I))
+                        FI.Switches.push_back(Switch);
+                    else if (llvm::isa<llvm::ReturnInst>(I) || llvm::isa<llvm::ResumeInst>(I))
+                        FI.Exits.push_back(&I);
+                }
+            }
+        }
+    }
+
+    // empty for declarations and for the functions created after the walk
+    const FunctionInstructions& get(const llvm::Function& F) const {
+        auto It = Functions.find(&F);
+        return It == Functions.end() ? Empty : It->second;
+    }
+};
+
+#endif
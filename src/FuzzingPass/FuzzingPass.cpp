@@ -8,15 +8,31 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/ADT/SetVector.h"
+#include <cstdlib>
+#include <set>
 #include <vector>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "FunctionFilter.h"
+#include "InstructionIndex.h"
+#ifdef SECURITY_PLUGIN
+#include "Plugin.h"
+#endif
+
 //#define DEBUG 1
 
 #ifdef DEBUG
@@ -31,8 +47,7 @@
 #define MIN_FCN_SIZE 1
 #define MAP_SIZE_POW2 16
 #define MAP_SIZE (1U << MAP_SIZE_POW2)
-
-#define CTX 1
+#define NGRAM_SIZE_MAX 8
 
 
 using namespace llvm;
@@ -43,7 +58,8 @@ static bool isBlacklisted(const Function& F) {
     static const char *Blacklist[] = {
 
         "asan.", "llvm.", "sancov.", "__ubsan_handle_", "ign.", "__afl_",
-        "_fini", "__libc_csu", "__asan",  "__msan", "msan.", "__sanitize"
+        "_fini", "__libc_csu", "__asan",  "__msan", "msan.", "__sanitize",
+        "fuzzing."
 
     };
 
@@ -59,6 +75,147 @@ static bool isBlacklisted(const Function& F) {
 
 }
 
+// BB dominates all its successors: it runs whenever one of them does
+static bool isFullDominator(const BasicBlock* BB, const DominatorTree& DT) {
+
+    if (succ_empty(BB))
+        return false;
+
+    return all_of(successors(BB), [&](const BasicBlock* Succ) {
+        return DT.dominates(BB, Succ);
+    });
+
+}
+
+// BB post-dominates all its predecessors: it runs whenever one of them does
+static bool isFullPostDominator(const BasicBlock* BB, const PostDominatorTree& PDT) {
+
+    if (pred_empty(BB))
+        return false;
+
+    return all_of(predecessors(BB), [&](const BasicBlock* Pred) {
+        return PDT.dominates(BB, Pred);
+    });
+
+}
+
+// Blocks whose coverage follows from the instrumented ones, with the rules of
+// SanitizerCoverage. A chain of single-successor blocks only keeps its last
+// block, since each one dominates the next. A block post-dominating several
+// predecessors is covered when any of them is. With a single predecessor it
+// is kept, because it still tells which edge out of that predecessor was taken.
+static bool isImpliedBlock(const BasicBlock* BB, const DominatorTree& DT, const PostDominatorTree& PDT) {
+
+    if (&BB->getParent()->getEntryBlock() == BB)
+        return false;
+
+    return isFullDominator(BB, DT) || (isFullPostDominator(BB, PDT) && !BB->getSinglePredecessor());
+
+}
+
+// CmpLog hook of the string and memory comparison routines, null for the other
+// functions. HasLength is set when the third argument bounds the comparison.
+static const char* getRoutineHook(StringRef Name, bool& HasLength) {
+
+    HasLength = true;
+    if (Name == "memcmp" || Name == "bcmp")
+        return "__cmplog_rtn_hook_n";
+    if (Name == "strncmp" || Name == "strncasecmp")
+        return "__cmplog_rtn_hook_strn";
+
+    HasLength = false;
+    if (Name == "strcmp" || Name == "strcasecmp")
+        return "__cmplog_rtn_hook_str";
+
+    return nullptr;
+
+}
+
+// The hook of a call to one of those routines, null when the callee only has
+// the name: the first two arguments must be pointers, the length an integer
+static const char* getRoutineHook(const CallBase* CB, bool& HasLength) {
+
+    const Function* Callee = CB->getCalledFunction();
+    if (!Callee)
+        return nullptr;
+    const char* Hook = getRoutineHook(Callee->getName(), HasLength);
+    if (!Hook || CB->arg_size() < (HasLength ? 3 : 2))
+        return nullptr;
+    if (!CB->getArgOperand(0)->getType()->isPointerTy() || !CB->getArgOperand(1)->getType()->isPointerTy())
+        return nullptr;
+    if (HasLength && !CB->getArgOperand(2)->getType()->isIntegerTy())
+        return nullptr;
+    return Hook;
+
+}
+
+// AFL++ encoding of a predicate: 1 equal, 2 greater, 4 lesser
+static unsigned getCmpAttribute(CmpInst::Predicate Pred) {
+
+    switch (Pred) {
+    case CmpInst::ICMP_EQ:
+        return 1;
+    case CmpInst::ICMP_UGT: case CmpInst::ICMP_SGT:
+        return 2;
+    case CmpInst::ICMP_UGE: case CmpInst::ICMP_SGE:
+        return 3;
+    case CmpInst::ICMP_ULT: case CmpInst::ICMP_SLT:
+        return 4;
+    case CmpInst::ICMP_ULE: case CmpInst::ICMP_SLE:
+        return 5;
+    default:
+        return 0;
+    }
+
+}
+
+// After the PHIs and the allocas, so that the static allocas stay together
+static Instruction* getInsertionPoint(BasicBlock& BB) {
+
+    BasicBlock::iterator It = BB.getFirstInsertionPt();
+    while (isa<AllocaInst>(*It))
+        ++It;
+    return &*It;
+
+}
+
+// Where the pass runs: clang runs it on each translation unit, the linker on
+// the merged module of an LTO build, opt on whatever it is given
+enum PassStage { Standalone, PreLink, LinkTime };
+
+// What a counter of the hashed map stands for, selected with FUZZING_COVERAGE:
+//   edge       the edge prev_loc -> cur_loc
+//   ctx        the edge, xored with a hash of the calling context (default)
+//   ngram-N    the last N blocks, N from 2 (the same as edge) to
+//              NGRAM_SIZE_MAX; the N - 1 previous locations are carried in a
+//              vector register and xored together
+//
+// Instructions added per instrumented block on x86-64 (llc -O2, SSE2), over
+// a chain of 400 blocks:
+//   edge 4.5, ctx 7.1 in functions calling others (4.5 in the rest),
+//   ngram-3 12.1, ngram-4 13.6, ngram-5 15.1, ngram-8 20.1
+enum CoverageMetric { EdgeCoverage, ContextCoverage, NGramCoverage };
+
+// How the threads of the target share the map, selected with FUZZING_THREADS:
+//   (unset)    plain increments, racing threads lose some
+//   atomic     relaxed atomic increments, which give up the never-zero
+//              carry, as the add and the carry can't be one atomic step
+//   private    each thread but the main one counts in a map of its own, that
+//              the runtime merges into the shared one at the end of the
+//              execution and when the thread exits; the executable has to
+//              be linked with -Wl,--wrap=pthread_create, as cc.py does
+enum ThreadSafety { SharedCounters, AtomicCounters, PrivateMaps };
+
+// The runtime is linked into the executable, where the initial-exec model
+// saves the __tls_get_addr call; shared libraries may be dlopen()ed
+static GlobalVariable::ThreadLocalMode getTLSModel(const Module& M) {
+
+    if (M.getPICLevel() == PICLevel::NotPIC || M.getPIELevel() != PIELevel::Default)
+        return GlobalVariable::InitialExecTLSModel;
+    return GlobalVariable::GeneralDynamicTLSModel;
+
+}
+
 struct FuzzingModulePass : public ModulePass {
   private:
 
@@ -66,20 +223,535 @@ struct FuzzingModulePass : public ModulePass {
 
 	Type *Int8Ty, *Int32Ty,*Int8PTy;
 
+    PassStage Stage;
+
+    CoverageMetric Metric;
+    unsigned NGramSize;
+
+    ThreadSafety Threads;
+
+    // FUZZING_SEQUENTIAL_IDS: every edge gets its own counter, numbered in
+    // order over the executable or shared library, instead of a random block ID
+    bool SequentialIDs;
+
+    // FUZZING_LIBFUZZER: -fsanitize-coverage counters instead of the AFL map
+    bool LibFuzzer;
+
+    // FUZZING_PRUNE: the blocks implied by others are not instrumented, their
+    // hit counts are lost but not their coverage
+    bool Prune;
+    size_t TotalBlocks, InstrumentedBlocks;
+
+    // FUZZING_CMPLOG: the operands of comparisons are logged in the AFL++
+    // CmpLog map, when the runtime has one. It only does in the comparison
+    // tracing run, so the same binary serves both runs.
+    bool CmpLog;
+
+    Function* ModuleCtor;
+
+    // FUZZING_ALLOWLIST, FUZZING_DENYLIST, FUZZING_PROFILE and FUZZING_DIFF
+    FunctionFilter Filter;
+
+    // the instructions of the program, collected before any instrumentation
+    const InstructionIndex* Index;
+
+    static bool isTracedInteger(Value* V) {
+        IntegerType* Ty = dyn_cast<IntegerType>(V->getType());
+        return Ty && Ty->getBitWidth() >= 8 && Ty->getBitWidth() <= 128 && !isa<Constant>(V);
+    }
+
+    // Collected before the coverage is added, which has comparisons of its own
+    vector<Instruction*> collectComparisons(Module& M) {
+        vector<Instruction*> Comparisons;
+        if (!CmpLog)
+            return Comparisons;
+
+        for (auto &F : M) {
+            if (!Filter.isSelected(F) || F.isDeclaration())
+                continue;
+            const FunctionInstructions& FI = Index->get(F);
+            for (ICmpInst* Cmp : FI.Compares) {
+                if (isTracedInteger(Cmp->getOperand(0)) || isTracedInteger(Cmp->getOperand(1)))
+                    Comparisons.push_back(Cmp);
+            }
+            for (SwitchInst* SI : FI.Switches) {
+                if (SI->getNumCases() && isTracedInteger(SI->getCondition()))
+                    Comparisons.push_back(SI);
+            }
+            for (CallBase* CB : FI.Calls) {
+                bool HasLength;
+                if (getRoutineHook(CB, HasLength))
+                    Comparisons.push_back(CB);
+            }
+        }
+        return Comparisons;
+    }
 
+    // __cmplog_ins_hook{1,2,4,8}(a, b, attribute), or for wider integers
+    // __cmplog_ins_hookN(a, b, attribute, size in bytes - 1)
+    void emitCmpHook(IRBuilder<>& IRB, Module& M, Value* A, Value* B, unsigned Attr) {
+        unsigned Width = A->getType()->getIntegerBitWidth();
+        unsigned Bits = Width <= 8 ? 8 : Width <= 16 ? 16 : Width <= 32 ? 32 : Width <= 64 ? 64 : 128;
+        Type* Ty = IntegerType::get(*C, Bits);
+
+        vector<Value*> Args = {IRB.CreateZExt(A, Ty), IRB.CreateZExt(B, Ty), ConstantInt::get(Int8Ty, Attr)};
+        string Name = "__cmplog_ins_hook" + to_string(Bits / 8);
+        if (Bits == 128) {
+            Args.push_back(ConstantInt::get(Int8Ty, (Width + 7) / 8 - 1));
+            Name = "__cmplog_ins_hookN";
+        }
+
+        vector<Type*> Params;
+        for (Value* Arg : Args)
+            Params.push_back(Arg->getType());
+        FunctionCallee Hook = M.getOrInsertFunction(Name, FunctionType::get(Type::getVoidTy(*C), Params, false));
+        CallInst* Call = IRB.CreateCall(Hook, Args);
+        // the hooks take u8 and u16 arguments
+        for (unsigned i = 0; i < Args.size(); i++) {
+            if (Args[i]->getType()->getIntegerBitWidth() < 32)
+                Call->addParamAttr(i, Attribute::ZExt);
+        }
+    }
+
+    // Every hook sits behind an unlikely branch on __afl_cmp_map, so the
+    // coverage runs only pay a load and a compare
+    size_t InstrumentComparisons(Module& M, vector<Instruction*>& Comparisons) {
+        if (Comparisons.empty())
+            return 0;
+
+        GlobalVariable *AFLCmpMap = new GlobalVariable(M, Int8PTy, false, GlobalValue::ExternalLinkage, 0, "__afl_cmp_map");
+        MDNode* Unlikely = MDBuilder(*C).createBranchWeights(1, 1000);
+        Type* Int64Ty = IntegerType::get(*C, 64);
+
+        for (Instruction* I : Comparisons) {
+            IRBuilder<> IRB(I);
+            LoadInst* CmpMap = IRB.CreateLoad(Int8PTy, AFLCmpMap);
+            CmpMap->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+            Instruction* Then = SplitBlockAndInsertIfThen(IRB.CreateIsNotNull(CmpMap), I, false, Unlikely);
+            IRB.SetInsertPoint(Then);
+
+            if (ICmpInst* Cmp = dyn_cast<ICmpInst>(I)) {
+                emitCmpHook(IRB, M, Cmp->getOperand(0), Cmp->getOperand(1), getCmpAttribute(Cmp->getPredicate()));
+            }
+            else if (SwitchInst* SI = dyn_cast<SwitchInst>(I)) {
+                for (auto Case : SI->cases())
+                    emitCmpHook(IRB, M, SI->getCondition(), Case.getCaseValue(), getCmpAttribute(CmpInst::ICMP_EQ));
+            }
+            else {
+                CallBase* CB = cast<CallBase>(I);
+                bool HasLength;
+                const char* Name = getRoutineHook(CB, HasLength);
+                vector<Value*> Args = {IRB.CreatePointerCast(CB->getArgOperand(0), Int8PTy),
+                                       IRB.CreatePointerCast(CB->getArgOperand(1), Int8PTy)};
+                if (HasLength)
+                    Args.push_back(IRB.CreateZExtOrTrunc(CB->getArgOperand(2), Int64Ty));
+                vector<Type*> Params;
+                for (Value* Arg : Args)
+                    Params.push_back(Arg->getType());
+                IRB.CreateCall(M.getOrInsertFunction(Name, FunctionType::get(Type::getVoidTy(*C), Params, false)), Args);
+            }
+        }
+        return Comparisons.size();
+    }
+
+    void printCmpLogStats(Module& M, size_t Comparisons) {
+        if (CmpLog && getenv("FUZZING_STATS"))
+            errs() << "FuzzingPass: " << M.getName() << ": " << Comparisons << " comparisons logged\n";
+    }
+
+    // The instrumentation reads and writes the globals through a stack slot,
+    // promoted to a register once the function is done
+    AllocaInst* createSlot(Function& F, Type* Ty, const Twine& Name) {
+        BasicBlock& Entry = F.getEntryBlock();
+        IRBuilder<> IRB(&Entry, Entry.getFirstInsertionPt());
+        return IRB.CreateAlloca(Ty, nullptr, Name);
+    }
+
+    // Loads the global in the slot at function entry and again after every
+    // call, which may change it; with WriteBack, stores it back before every
+    // call and before leaving. Runs after the blocks are instrumented, so that
+    // the stores come after the updates of the block. A null pointer read from
+    // GV is replaced with the value of Fallback.
+    void fillSlot(AllocaInst* Slot, GlobalVariable* GV, bool WriteBack,
+                  const vector<CallBase*>& Calls, const vector<Instruction*>& Exits,
+                  GlobalVariable* Fallback = nullptr) {
+
+        Module& M = *Slot->getModule();
+        Type* Ty = Slot->getAllocatedType();
+
+        auto Reload = [&](Instruction* Before) {
+            IRBuilder<> IRB(Before);
+            LoadInst* Load = IRB.CreateLoad(Ty, GV);
+            Load->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+            Value* V = Load;
+            if (Fallback) {
+                LoadInst* Other = IRB.CreateLoad(Ty, Fallback);
+                Other->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+                V = IRB.CreateSelect(IRB.CreateIsNull(Load), Other, Load);
+            }
+            IRB.CreateStore(V, Slot);
+        };
+        auto Store = [&](Instruction* Before) {
+            IRBuilder<> IRB(Before);
+            StoreInst* Update = IRB.CreateStore(IRB.CreateLoad(Ty, Slot), GV);
+            Update->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+        };
+
+        Reload(Slot->getNextNode());
+
+        set<BasicBlock*> Reloaded;
+        for (CallBase* CB : Calls) {
+            if (WriteBack)
+                Store(CB);
+
+            if (CallInst* CI = dyn_cast<CallInst>(CB)) {
+                // nothing can follow a musttail call but the ret
+                if (!CI->isMustTailCall())
+                    Reload(CI->getNextNode());
+            }
+            else if (InvokeInst* II = dyn_cast<InvokeInst>(CB)) {
+                // the destinations reached from elsewhere keep the value in the slot
+                for (BasicBlock* Dest : {II->getNormalDest(), II->getUnwindDest()}) {
+                    if ((Dest->getSinglePredecessor() || Dest->isLandingPad()) && Reloaded.insert(Dest).second)
+                        Reload(&*Dest->getFirstInsertionPt());
+                }
+            }
+        }
+
+        if (!WriteBack)
+            return;
+        for (Instruction* I : Exits) {
+            if (!I->getParent()->getTerminatingMustTailCall())
+                Store(I);
+        }
+    }
+
+    // map[Idx]++, never wrapping to zero (as afl++)
+    void IncrementCounter(IRBuilder<>& IRB, Value* MapPtr, Value* Idx) {
+
+        Module& M = *IRB.GetInsertBlock()->getModule();
+
+        Value* MapPtrIdx = IRB.CreateGEP(Int8Ty, MapPtr, Idx);
+
+        if (Threads == AtomicCounters) {
+            AtomicRMWInst* Add = IRB.Insert(new AtomicRMWInst(AtomicRMWInst::Add, MapPtrIdx, ConstantInt::get(Int8Ty, 1),
+                                                              Align(1), AtomicOrdering::Monotonic, SyncScope::System));
+            Add->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+            return;
+        }
+
+        LoadInst* NumberOfHits = IRB.CreateLoad(Int8Ty, MapPtrIdx);
+        NumberOfHits->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+
+        Value* Add = IRB.CreateAdd(NumberOfHits, ConstantInt::get(Int8Ty, 1));
+            
+        // Never Zero from afl++
+        Constant* ZeroConst = ConstantInt::get(Int8Ty, 0);
+        auto comparisonFlag = IRB.CreateICmpEQ(Add, ZeroConst);
+        auto carry = IRB.CreateZExt(comparisonFlag, Int8Ty);
+        Add = IRB.CreateAdd(Add, carry);
+
+        StoreInst* UpdateHits = IRB.CreateStore(Add, MapPtrIdx);
+        UpdateHits->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+    }
+
+    // Runs before any other constructor, the calls to the runtime go before
+    // its ret
+    Instruction* getModuleCtorEnd(Module& M) {
+        if (!ModuleCtor) {
+            ModuleCtor = Function::Create(FunctionType::get(Type::getVoidTy(*C), false),
+                                          GlobalValue::InternalLinkage, "fuzzing.module_ctor", M);
+            ReturnInst::Create(*C, BasicBlock::Create(*C, "", ModuleCtor));
+            appendToGlobalCtors(M, ModuleCtor, 0);
+        }
+        return ModuleCtor->getEntryBlock().getTerminator();
+    }
+
+    // The shared map, whole
+    GlobalVariable* getSharedArea(Module& M) {
+        if (GlobalVariable* GV = M.getNamedGlobal("__afl_area_ptr"))
+            return GV;
+        return new GlobalVariable(M, Int8PTy, false, GlobalValue::ExternalLinkage, 0, "__afl_area_ptr");
+    }
+
+    // The map of the running thread with FUZZING_THREADS=private, null otherwise.
+    // The runtime leaves it null in the threads without a map of their own,
+    // which count in the shared map.
+    GlobalVariable* getThreadArea(Module& M) {
+        if (Threads != PrivateMaps)
+            return nullptr;
+
+        IRBuilder<> IRB(getModuleCtorEnd(M));
+        IRB.CreateCall(M.getOrInsertFunction("__afl_enable_private_maps", Type::getVoidTy(*C)));
+        return new GlobalVariable(M, Int8PTy, false, GlobalValue::ExternalLinkage, 0, "__afl_thread_area_ptr",
+                                  0, getTLSModel(M), 0, false);
+    }
+
+    // Returns the block that runs exactly when the edge Pred->BB is taken,
+    // splitting the edge if it is critical, or null if it can't be split
+    // (indirectbr, callbr and exception edges)
+    BasicBlock* getEdgeBlock(BasicBlock* Pred, BasicBlock* BB) {
+        Instruction* Term = Pred->getTerminator();
+        if (Term->getNumSuccessors() == 1)
+            return Pred;
+
+        if (BB->isEHPad() || isa<IndirectBrInst>(Term) || isa<CallBrInst>(Term))
+            return nullptr;
+
+        for (unsigned i = 0; i < Term->getNumSuccessors(); i++) {
+            if (Term->getSuccessor(i) == BB)
+                // switch cases sharing BB are merged onto the same new block
+                return SplitCriticalEdge(Term, i, CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+        }
+        return nullptr;
+    }
+
+    // The entry block and the blocks with a single predecessor identify
+    // their incoming edge, the other edges get a block of their own. So every
+    // counter is hit by exactly one edge, and there are no collisions.
+    vector<Instruction*> collectEdgeLocations(Function& F) {
+
+        vector<Instruction*> Locations;
+        vector<BasicBlock*> Blocks;
+        for (auto &BB : F)
+            Blocks.push_back(&BB);
+
+        for (BasicBlock* BB : Blocks) {
+            if (BB->hasNPredecessorsOrMore(2) && !BB->getUniquePredecessor()) {
+                SetVector<BasicBlock*> Preds(pred_begin(BB), pred_end(BB));
+                bool Shared = false;
+                for (BasicBlock* Pred : Preds) {
+                    if (BasicBlock* Edge = getEdgeBlock(Pred, BB))
+                        Locations.push_back(Edge->getTerminator());
+                    else
+                        Shared = true;
+                }
+                // the edges that can't be split share the counter of BB
+                if (Shared)
+                    Locations.push_back(getInsertionPoint(*BB));
+            }
+            else {
+                Locations.push_back(getInsertionPoint(*BB));
+            }
+        }
+
+        // the CFG is final, the trees are computed on the split edges
+        set<BasicBlock*> Instrumented;
+        if (Prune) {
+            DominatorTree DT(F);
+            PostDominatorTree PDT(F);
+            vector<Instruction*> Kept;
+            for (Instruction* I : Locations) {
+                // two counters in the same block would always be equal
+                if (Instrumented.count(I->getParent()) || isImpliedBlock(I->getParent(), DT, PDT))
+                    continue;
+                Instrumented.insert(I->getParent());
+                Kept.push_back(I);
+            }
+            Locations.swap(Kept);
+        }
+        else {
+            for (Instruction* I : Locations)
+                Instrumented.insert(I->getParent());
+        }
+        TotalBlocks += F.size();
+        InstrumentedBlocks += Instrumented.size();
+
+        return Locations;
+    }
+
+    // The counters of the module are a slice of the map that the runtime
+    // hands out when the module registers, so that the executable and each
+    // instrumented shared library don't overlap.
+    uint32_t InstrumentEdges(Module& M) {
+
+        GlobalVariable *ModuleArea = new GlobalVariable(M, Int8PTy, false, GlobalValue::InternalLinkage,
+                                                        ConstantPointerNull::get(cast<PointerType>(Int8PTy)),
+                                                        "fuzzing.area_ptr");
+        GlobalVariable *ModuleBase = new GlobalVariable(M, Int32Ty, false, GlobalValue::InternalLinkage,
+                                                        ConstantInt::get(Int32Ty, 0), "fuzzing.area_base");
+        GlobalVariable *ThreadArea = getThreadArea(M);
+
+        uint32_t NextID = 0;
+
+        for (auto &F: M) {
+
+            if (!Filter.isSelected(F) || F.size() < MIN_FCN_SIZE)
+                continue;
+
+            vector<Instruction*> Locations = collectEdgeLocations(F);
+
+            // calls may run instrumented code, the exits leave the function
+            const FunctionInstructions& FI = Index->get(F);
+            AllocaInst* MapPtrSlot = createSlot(F, Int8PTy, "afl_area_ptr");
+
+            // the thread maps are whole maps, the slice starts at its base
+            Value* Base = nullptr;
+            if (ThreadArea) {
+                IRBuilder<> IRB(getInsertionPoint(F.getEntryBlock()));
+                Base = IRB.CreateLoad(Int32Ty, ModuleBase);
+            }
+
+            for (Instruction* I : Locations) {
+                IRBuilder<> IRB(I);
+                Value* Idx = ConstantInt::get(Int32Ty, NextID++);
+                if (Base)
+                    Idx = IRB.CreateAdd(Base, Idx);
+                IncrementCounter(IRB, IRB.CreateLoad(Int8PTy, MapPtrSlot), Idx);
+            }
+
+            // the runtime moves the slice when it attaches the map
+            if (ThreadArea)
+                fillSlot(MapPtrSlot, ThreadArea, false, FI.Calls, FI.Exits, getSharedArea(M));
+            else
+                fillSlot(MapPtrSlot, ModuleArea, false, FI.Calls, FI.Exits);
+            DominatorTree DT(F);
+            PromoteMemToReg({MapPtrSlot}, DT);
+        }
+
+        // fuzzing.area_base = __afl_register_module(&fuzzing.area_ptr, edges),
+        // before any other constructor can run; the runtime sizes the map
+        // from the total
+        FunctionCallee Register = M.getOrInsertFunction("__afl_register_module", Int32Ty,
+                                                        PointerType::get(Int8PTy, 0), Int32Ty);
+        IRBuilder<> IRB(getModuleCtorEnd(M));
+        Value* ModuleBaseValue = IRB.CreateCall(Register, {ModuleArea, ConstantInt::get(Int32Ty, NextID)});
+        IRB.CreateStore(ModuleBaseValue, ModuleBase);
+
+        return NextID;
+    }
+
+    // A section of the per-function arrays, bounded by the __start_ and
+    // __stop_ symbols the linker defines
+    GlobalVariable* createSectionArray(Module& M, Function& F, Constant* Init, StringRef Section) {
+        GlobalVariable* Array = new GlobalVariable(M, Init->getType(), false, GlobalValue::PrivateLinkage,
+                                                   Init, "__sancov_gen_");
+        Array->setSection(Section);
+        Array->setAlignment(M.getDataLayout().getABITypeAlign(Init->getType()->getArrayElementType()));
+        // dropped by the linker together with F
+        Array->setMetadata(LLVMContext::MD_associated, MDNode::get(*C, ValueAsMetadata::get(&F)));
+        if (Comdat* FComdat = F.getComdat())
+            Array->setComdat(FComdat);
+        return Array;
+    }
+
+    // FUZZING_LIBFUZZER: the counters are the inline 8-bit counters of
+    // -fsanitize-coverage, one array per function in __sancov_cntrs, with the
+    // table of their PCs in __sancov_pcs, so that the module can be linked
+    // with the in-process engine of -fsanitize=fuzzer
+    size_t InstrumentInlineCounters(Module& M) {
+
+        Type* IntptrTy = M.getDataLayout().getIntPtrType(*C);
+        vector<GlobalValue*> Used;
+        size_t Counters = 0;
+
+        for (auto &F: M) {
+
+            if (!Filter.isSelected(F) || F.isDeclaration() || F.size() < MIN_FCN_SIZE)
+                continue;
+
+            vector<Instruction*> Locations = collectEdgeLocations(F);
+            if (Locations.empty())
+                continue;
+
+            ArrayType* CountersTy = ArrayType::get(Int8Ty, Locations.size());
+            GlobalVariable* Array = createSectionArray(M, F, Constant::getNullValue(CountersTy), "__sancov_cntrs");
+
+            // pairs of PC and flags, the flag 1 marks the entry of the function;
+            // the entry block may hold the counter of its outgoing edge too
+            vector<Constant*> PCs;
+            for (Instruction* I : Locations) {
+                BasicBlock* BB = I->getParent();
+                bool Entry = BB == &F.getEntryBlock();
+                Constant* PC = Entry ? static_cast<Constant*>(&F) : BlockAddress::get(BB);
+                PCs.push_back(ConstantExpr::getPointerCast(PC, IntptrTy));
+                PCs.push_back(ConstantInt::get(IntptrTy, Entry && PCs.size() == 1));
+            }
+            ArrayType* PCsTy = ArrayType::get(IntptrTy, PCs.size());
+            GlobalVariable* Table = createSectionArray(M, F, ConstantArray::get(PCsTy, PCs), "__sancov_pcs");
+            Table->setConstant(true);
+
+            Constant* ArrayPtr = ConstantExpr::getPointerCast(Array, Int8PTy);
+            for (unsigned i = 0; i < Locations.size(); i++) {
+                IRBuilder<> IRB(Locations[i]);
+                IncrementCounter(IRB, ArrayPtr, ConstantInt::get(Int32Ty, i));
+            }
+
+            Used.push_back(Array);
+            Used.push_back(Table);
+            Counters += Locations.size();
+        }
+
+        if (Used.empty())
+            return 0;
+        appendToCompilerUsed(M, Used);
+
+        // __sanitizer_cov_8bit_counters_init(start, stop) and
+        // __sanitizer_cov_pcs_init(start, stop) on the sections
+        auto SectionBound = [&](const char* Name, Type* Ty) {
+            GlobalVariable* Bound = new GlobalVariable(M, Ty, false, GlobalValue::ExternalWeakLinkage,
+                                                       nullptr, Name);
+            Bound->setVisibility(GlobalValue::HiddenVisibility);
+            return Bound;
+        };
+        IRBuilder<> IRB(getModuleCtorEnd(M));
+        Type* IntptrPTy = PointerType::get(IntptrTy, 0);
+        IRB.CreateCall(M.getOrInsertFunction("__sanitizer_cov_8bit_counters_init", Type::getVoidTy(*C), Int8PTy, Int8PTy),
+                       {SectionBound("__start___sancov_cntrs", Int8Ty), SectionBound("__stop___sancov_cntrs", Int8Ty)});
+        IRB.CreateCall(M.getOrInsertFunction("__sanitizer_cov_pcs_init", Type::getVoidTy(*C), IntptrPTy, IntptrPTy),
+                       {SectionBound("__start___sancov_pcs", IntptrTy), SectionBound("__stop___sancov_pcs", IntptrTy)});
+
+        return Counters;
+    }
+
+    void printBlockStats(Module& M) {
+        errs() << "FuzzingPass: " << M.getName() << ": " << InstrumentedBlocks << " of " << TotalBlocks
+               << " blocks instrumented";
+        if (TotalBlocks)
+            errs() << format(" (%.1f%%)", 100.0 * InstrumentedBlocks / TotalBlocks);
+        errs() << "\n";
+    }
 
   public:
     
 
   static char ID;
 
-  explicit FuzzingModulePass() : ModulePass(ID) {}
-
+  explicit FuzzingModulePass(PassStage Stage = Standalone)
+      : ModulePass(ID), Stage(Stage), Filter("FuzzingPass", "FUZZING", "fuzzing") {
+    SequentialIDs = getenv("FUZZING_SEQUENTIAL_IDS") != nullptr;
+    LibFuzzer = getenv("FUZZING_LIBFUZZER") != nullptr;
+    Prune = getenv("FUZZING_PRUNE") != nullptr;
+    CmpLog = getenv("FUZZING_CMPLOG") != nullptr;
+
+    Metric = ContextCoverage;
+    NGramSize = 0;
+    if (const char* Coverage = getenv("FUZZING_COVERAGE")) {
+        StringRef Name(Coverage);
+        if (Name == "edge")
+            Metric = EdgeCoverage;
+        else if (Name == "ctx")
+            Metric = ContextCoverage;
+        else if (Name.consume_front("ngram-") && !Name.getAsInteger(10, NGramSize) &&
+                 NGramSize >= 2 && NGramSize <= NGRAM_SIZE_MAX)
+            // a 2-gram is an edge, and the scalar code is cheaper
+            Metric = NGramSize == 2 ? EdgeCoverage : NGramCoverage;
+        else
+            report_fatal_error("FuzzingPass: FUZZING_COVERAGE must be edge, ctx or ngram-N with N between 2 and 8");
+    }
 
-  void getAnalysisUsage(AnalysisUsage &AU) const override {
-    AU.addRequired<LoopInfoWrapperPass>();
+    Threads = SharedCounters;
+    if (const char* Mode = getenv("FUZZING_THREADS")) {
+        if (StringRef(Mode) == "atomic")
+            Threads = AtomicCounters;
+        else if (StringRef(Mode) == "private")
+            Threads = PrivateMaps;
+        else
+            report_fatal_error("FuzzingPass: FUZZING_THREADS must be atomic or private");
+    }
   }
 
+
   bool doInitialization(Module &M) override {
 
     struct timeval tv;
@@ -93,66 +765,135 @@ struct FuzzingModulePass : public ModulePass {
   }
   
   bool runOnModule(Module &M) override {
+    InstructionIndex Index(M);
+    return instrumentModule(M, Index);
+  }
+
+  bool instrumentModule(Module &M, const InstructionIndex &Index) {
 
+    this->Index = &Index;
+    Filter.select(M, isBlacklisted);
     C = &(M.getContext());
 
     Int8Ty = IntegerType::get(*C, 8);
     Int32Ty = IntegerType::get(*C, 32);
     Int8PTy  = PointerType::get(Int8Ty, 0);
 
-    Constant* OneConst = ConstantInt::get(Int8Ty, 1);
+    TotalBlocks = InstrumentedBlocks = 0;
+    ModuleCtor = nullptr;
+
+    // the counters are per function, each translation unit is instrumented
+    // on its own
+    if (LibFuzzer) {
+        if (Stage == LinkTime)
+            return false;
+        if (getenv("FUZZING_COVERAGE") || getenv("FUZZING_THREADS") || CmpLog)
+            errs() << "FuzzingPass: FUZZING_LIBFUZZER ignores FUZZING_COVERAGE, FUZZING_THREADS and FUZZING_CMPLOG\n";
+        // plain increments, atomic ones would lose the never-zero carry
+        Threads = SharedCounters;
+        size_t Counters = InstrumentInlineCounters(M);
+        if (getenv("FUZZING_STATS")) {
+            errs() << "FuzzingPass: " << M.getName() << ": " << Counters << " inline 8-bit counters\n";
+            printBlockStats(M);
+        }
+        return true;
+    }
+
+    // sequential IDs are only unique on the linked module, so the
+    // translation units are left alone and instrumented by the linker
+    if (SequentialIDs) {
+        if (Stage == PreLink)
+            return false;
+        if (getenv("FUZZING_COVERAGE") && Metric != EdgeCoverage)
+            errs() << "FuzzingPass: FUZZING_COVERAGE is ignored with FUZZING_SEQUENTIAL_IDS, every edge has its own counter\n";
+        vector<Instruction*> Comparisons = collectComparisons(M);
+        uint32_t Edges = InstrumentEdges(M);
+        size_t Logged = InstrumentComparisons(M, Comparisons);
+        if (getenv("FUZZING_STATS")) {
+            errs() << "FuzzingPass: " << M.getName() << ": " << Edges << " edges\n";
+            printBlockStats(M);
+        }
+        printCmpLogStats(M, Logged);
+        return true;
+    }
+    if (Stage == LinkTime)
+        return false;
+
+    vector<Instruction*> Comparisons = collectComparisons(M);
 
     unsigned int cur_loc = 0;
-    unsigned int ctx = CTX;
+    bool ctx = Metric == ContextCoverage;
     uint32_t map_size = MAP_SIZE;
 
-    GlobalVariable *AFLPrevLocation = new GlobalVariable(M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc", 0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
-    GlobalVariable *AFLBitmap = new GlobalVariable(M, Int8PTy, false, GlobalValue::ExternalLinkage, 0, "__afl_area_ptr");
+    // the n-gram history: the previous location in lane 0, the older ones
+    // after it and zeros in the lanes past N - 1
+    Type* PrevLocTy = Int32Ty;
+    unsigned HistoryWidth = 0;
+    SmallVector<int, NGRAM_SIZE_MAX> ShiftMask;
+    if (Metric == NGramCoverage) {
+        HistoryWidth = PowerOf2Ceil(NGramSize - 1);
+        PrevLocTy = FixedVectorType::get(Int32Ty, HistoryWidth);
+        // lane 0 of the second operand is the new location, lane 1 is zero
+        ShiftMask.push_back(HistoryWidth);
+        for (unsigned i = 1; i < HistoryWidth; i++)
+            ShiftMask.push_back(i < NGramSize - 1 ? i - 1 : HistoryWidth + 1);
+    }
+
+    GlobalVariable::ThreadLocalMode TLSModel = getTLSModel(M);
+
+    GlobalVariable *AFLPrevLocation = new GlobalVariable(M, PrevLocTy, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc", 0, TLSModel, 0, false);
+    GlobalVariable *AFLBitmap = getSharedArea(M);
+    GlobalVariable *ThreadArea = getThreadArea(M);
 
     GlobalVariable *AFLContext = nullptr;
 
     if (ctx) {
 
-        AFLContext = new GlobalVariable(M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_ctx", 0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+        AFLContext = new GlobalVariable(M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_ctx", 0, TLSModel, 0, false);
     }
 
 
 
     for (auto &F: M) {
 
-        if (isBlacklisted(F) || F.size() < MIN_FCN_SIZE)
+        if (!Filter.isSelected(F) || F.size() < MIN_FCN_SIZE)
             continue;
 
+        DominatorTree DT;
+        PostDominatorTree PDT;
+        if (Prune) {
+            DT.recalculate(F);
+            PDT.recalculate(F);
+        }
+        TotalBlocks += F.size();
+
+        // the map pointer and the previous location stay in registers, the
+        // latter is written back for the callees and the caller
+        const FunctionInstructions& FI = Index.get(F);
+        AllocaInst* MapPtrSlot = createSlot(F, Int8PTy, "afl_area_ptr");
+        AllocaInst* PrevLocSlot = createSlot(F, PrevLocTy, "afl_prev_loc");
+
         int are_there_calls = 0;
+        // the calling context, loaded in the entry block of non-leaf functions
+        Value* PrevCtx = nullptr;
         for (auto &BB : F) {
-            Value* PrevCtx = nullptr;
 
-            BasicBlock::iterator InsertionPoint = BB.getFirstInsertionPt();
-            IRBuilder<> IRB(&(*InsertionPoint));
+            IRBuilder<> IRB(getInsertionPoint(BB));
 
             if (ctx) {
                 if (&BB == &F.getEntryBlock()) {
                     // We skip leaf functions
 
-                    for (auto &SecondBB : F) {
-                        if (are_there_calls)
-                            break;
-                        
-                        for (auto &I : SecondBB) {
-                            if (CallInst* CI = dyn_cast<CallInst>(&I)) {
-                                Function *Callee = CI->getCalledFunction();
-                                if (!Callee || Callee->size() < MIN_FCN_SIZE)
-                                    continue;
-                                else {
-                                    are_there_calls = 1;
-                                    break;
-                                }
-                            }
-                        }
+                    for (CallBase* CB : FI.Calls) {
+                        Function *Callee = CB->getCalledFunction();
+                        if (!isa<CallInst>(CB) || !Callee || Callee->size() < MIN_FCN_SIZE)
+                            continue;
+                        are_there_calls = 1;
+                        break;
                     }
                     if (are_there_calls) {
 
-                        LoadInst* PrevCtxLoad = IRB.CreateLoad(AFLContext);
+                        LoadInst* PrevCtxLoad = IRB.CreateLoad(Int32Ty, AFLContext);
                         PrevCtx = static_cast<Value*>(PrevCtxLoad);
     
                         unsigned cur_ctx = random() % MAP_SIZE;
@@ -164,39 +905,6 @@ struct FuzzingModulePass : public ModulePass {
                 }
             }
 
-            cur_loc = random() % map_size;
-            Constant* CurLoc = ConstantInt::get(Int32Ty, cur_loc);
-            
-            LoadInst* LoadPrevLoc = IRB.CreateLoad(AFLPrevLocation);
-            LoadPrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
-            Value* PrevLoc = static_cast<Value*>(LoadPrevLoc);
-
-            if (ctx) {
-                PrevLoc = IRB.CreateZExt(IRB.CreateXor(PrevLoc, PrevCtx), Int32Ty);
-            }
-
-            LoadInst* MapPtr = IRB.CreateLoad(AFLBitmap);
-            MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
-
-            Value* MapPtrIdx = IRB.CreateGEP(MapPtr, IRB.CreateXor(PrevLoc, CurLoc));
-
-            LoadInst* NumberOfHits = IRB.CreateLoad(MapPtrIdx);
-            NumberOfHits->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
-
-            Value* Add = IRB.CreateAdd(NumberOfHits, OneConst);
-            
-            // Never Zero from afl++
-            Constant* ZeroConst = ConstantInt::get(Int8Ty, 0);
-            auto comparisonFlag = IRB.CreateICmpEQ(Add, ZeroConst);
-            auto carry = IRB.CreateZExt(comparisonFlag, Int8Ty);
-            Add = IRB.CreateAdd(Add, carry);
-
-            StoreInst* UpdateHits = IRB.CreateStore(Add, MapPtrIdx);
-            UpdateHits->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
-
-            StoreInst* UpdatePrevLocation = IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLocation);
-            UpdatePrevLocation->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
-
             if (ctx && are_there_calls) {
                 //restore old ctx when return
                 Instruction* I = BB.getTerminator();
@@ -207,22 +915,85 @@ struct FuzzingModulePass : public ModulePass {
                 }
             }
 
+            if (Prune && isImpliedBlock(&BB, DT, PDT))
+                continue;
+            InstrumentedBlocks++;
+
+            cur_loc = random() % map_size;
+            Constant* CurLoc = ConstantInt::get(Int32Ty, cur_loc);
+            
+            Value* PrevLoc = IRB.CreateLoad(PrevLocTy, PrevLocSlot);
+            Value* NextLoc = ConstantInt::get(Int32Ty, cur_loc >> 1);
+
+            if (Metric == NGramCoverage) {
+                // the oldest location drops out of the history
+                SmallVector<Constant*, NGRAM_SIZE_MAX> Lanes(HistoryWidth, ConstantInt::get(Int32Ty, 0));
+                Lanes[0] = cast<Constant>(NextLoc);
+                NextLoc = IRB.CreateShuffleVector(PrevLoc, ConstantVector::get(Lanes), ShiftMask);
+                PrevLoc = IRB.CreateXorReduce(PrevLoc);
+            }
+
+            if (ctx && PrevCtx) {
+                PrevLoc = IRB.CreateZExt(IRB.CreateXor(PrevLoc, PrevCtx), Int32Ty);
+            }
+
+            Value* MapPtr = IRB.CreateLoad(Int8PTy, MapPtrSlot);
+
+            IncrementCounter(IRB, MapPtr, IRB.CreateXor(PrevLoc, CurLoc));
+
+            IRB.CreateStore(NextLoc, PrevLocSlot);
+
         }
+
+        if (ThreadArea)
+            fillSlot(MapPtrSlot, ThreadArea, false, FI.Calls, FI.Exits, AFLBitmap);
+        else
+            fillSlot(MapPtrSlot, AFLBitmap, false, FI.Calls, FI.Exits);
+        fillSlot(PrevLocSlot, AFLPrevLocation, true, FI.Calls, FI.Exits);
+        DT.recalculate(F);
+        PromoteMemToReg({MapPtrSlot, PrevLocSlot}, DT);
         
     
     }
     
+    size_t Logged = InstrumentComparisons(M, Comparisons);
 
-    return false;
+    if (getenv("FUZZING_STATS"))
+        printBlockStats(M);
+    printCmpLogStats(M, Logged);
+
+    return true;
   }
 }; 
 
 char FuzzingModulePass::ID = 0;
 
+#ifdef SECURITY_PLUGIN
+PreservedAnalyses FuzzingPass::run(Module &M, ModuleAnalysisManager &MAM) {
+
+  FuzzingModulePass Pass(IsPreLink ? PreLink : Standalone);
+  Pass.doInitialization(M);
+  if (!Pass.instrumentModule(M, MAM.getResult<InstructionIndexAnalysis>(M)))
+    return PreservedAnalyses::all();
+
+  // blocks are split and code added, but no instruction of the program erased
+  PreservedAnalyses PA = PreservedAnalyses::none();
+  PA.preserve<InstructionIndexAnalysis>();
+  return PA;
+
+}
+#else
 static void registerFuzzingPass(const PassManagerBuilder &,
                                legacy::PassManagerBase &PM) {
 
-  PM.add(new FuzzingModulePass());
+  PM.add(new FuzzingModulePass(PreLink));
+
+}
+
+static void registerFuzzingLTOPass(const PassManagerBuilder &,
+                                   legacy::PassManagerBase &PM) {
+
+  PM.add(new FuzzingModulePass(LinkTime));
 
 }
 
@@ -232,8 +1003,13 @@ static RegisterStandardPasses RegisterFuzzingPass(
 static RegisterStandardPasses RegisterFuzzingPass0(
     PassManagerBuilder::EP_EnabledOnOptLevel0, registerFuzzingPass);
 
+// loaded in the linker with -Wl,-mllvm=-load=FuzzingPass.so
+static RegisterStandardPasses RegisterFuzzingLTOPass(
+    PassManagerBuilder::EP_FullLinkTimeOptimizationLast, registerFuzzingLTOPass);
+
 static RegisterPass<FuzzingModulePass>
     X("Fuzzing", "FuzzingPass",
       false,
       false
     );
+#endif
@@ -5,8 +5,7 @@ import sys
 import os
 
 script_dir = os.path.dirname(os.path.realpath(os.path.abspath(__file__)))
-aflpp_path = os.path.join(script_dir, "..", "..", "AFLplusplus")
-runtime_path = os.path.join(aflpp_path, "./afl-compiler-rt.o")
+runtime_path = os.path.join(script_dir, "fuzzing-rt.o")
 
 
 assert(os.path.isfile(runtime_path) and "runtime file doesn't exist")
@@ -34,28 +33,83 @@ def common_opts():
       "-g",
       "-fno-inline-functions",
       "-fno-discard-value-names",
+    ] + manual_control_opts()
+
+def manual_control_opts():
+    # __AFL_LOOP and __AFL_INIT as in afl-clang-fast: the signature strings
+    # tell afl-fuzz to turn on persistent mode and the deferred forkserver
+    return [
+      "-D__AFL_HAVE_MANUAL_CONTROL=1",
+      "-D__AFL_COMPILER=1",
+      "-DFUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION=1",
+      "-D__AFL_LOOP(_A)=({ static volatile const char *_B __attribute__((used, unused)); "
+      "_B = (const char*)\"##SIG_AFL_PERSISTENT##\"; "
+      "int _L(unsigned int) __asm__(\"__afl_persistent_loop\"); _L(_A); })",
+      "-D__AFL_INIT()=do { static volatile const char *_A __attribute__((used, unused)); "
+      "_A = (const char*)\"##SIG_AFL_DEFER_FORKSRV##\"; "
+      "void _I(void) __asm__(\"__afl_manual_init\"); _I(); } while (0)",
+    ]
+
+def lto_opts():
+    # FUZZING_SEQUENTIAL_IDS numbers the edges on the whole program, which
+    # only the linker sees: the pass is loaded into lld and runs on the LTO module
+    if not os.getenv("FUZZING_SEQUENTIAL_IDS") or os.getenv("FUZZING_LIBFUZZER"):
+        return []
+    return ["-flto=full"]
+
+def lto_link_opts():
+    # executables and shared libraries alike, each gets its slice of the map
+    if not os.getenv("FUZZING_SEQUENTIAL_IDS") or os.getenv("FUZZING_LIBFUZZER"):
+        return []
+    return [
+      "-fuse-ld=lld",
+      "-Wl,-mllvm=-load=" + os.path.join(script_dir, "./FuzzingPass.so"),
     ]
 
 def cc_mode():
     args = common_opts()
+    args += lto_opts()
     args += sys.argv[1:]
 
+    # the runtime stays in the executable, which exports it to the libraries
+    if "-shared" in sys.argv:
+        args += lto_link_opts()
+
     args += [
-      "-Xclang", "-load", "-Xclang", os.path.join(script_dir, "./FuzzingPass/FuzzingPass.so"),
+      "-Xclang", "-load", "-Xclang", os.path.join(script_dir, "./FuzzingPass.so"),
     ]
     return cc_exec(args)
 
+def libfuzzer_opts():
+    # the engine of -fsanitize=fuzzer reads our counters, its own
+    # instrumentation is turned off
+    return [
+      "-fsanitize=fuzzer",
+      "-fno-sanitize-coverage=inline-8bit-counters,indirect-calls,trace-cmp,pc-table",
+    ]
+
 def ld_mode():
     args = common_opts()
+    args += lto_opts()
     
     args += sys.argv[1:]
-    args += [runtime_path]
+    if os.getenv("FUZZING_LIBFUZZER"):
+        args += libfuzzer_opts()
+    else:
+        args += [runtime_path]
+    args += lto_link_opts()
 
     args += [
-      "-Xclang", "-load", "-Xclang", os.path.join(script_dir, "./FuzzingPass/FuzzingPass.so"),
+      "-Xclang", "-load", "-Xclang", os.path.join(script_dir, "./FuzzingPass.so"),
     ]
 
-    #args += ["-ldl"]
+    # the runtime gives every new thread its map through a pthread_create
+    # wrapper, only linked in when the threads count privately; -u keeps the
+    # real one, which static links would otherwise drop
+    if os.getenv("FUZZING_THREADS") == "private" and not os.getenv("FUZZING_LIBFUZZER"):
+        args += ["-Wl,--wrap=pthread_create", "-Wl,-u,pthread_create"]
+
+    args += ["-lpthread", "-ldl"]
     
     return cc_exec(args)
 
@@ -0,0 +1,429 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "coverage-map.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+
+/* xxh3 style accumulation: each line is mixed with a key salted by its index */
+static const uint64_t hash_secret[8] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+static const uint64_t hash_init[8] = {
+    PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_1 ^ PRIME64_2,
+    PRIME64_2 ^ PRIME64_3, PRIME64_3 ^ PRIME64_1, ~PRIME64_1, ~PRIME64_2,
+};
+
+/* bucket of a hit count: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ */
+static uint8_t count_class_lookup8[256];
+static uint16_t count_class_lookup16[65536];
+
+static void init_lookup() {
+
+    static int initialized = 0;
+    if (initialized)
+        return;
+
+    for (unsigned i = 0; i < 256; i++) {
+        uint8_t c = i == 0 ? 0 : i == 1 ? 1 : i == 2 ? 2 : i == 3 ? 4 : i < 8 ? 8 :
+                    i < 16 ? 16 : i < 32 ? 32 : i < 128 ? 64 : 128;
+        count_class_lookup8[i] = c;
+    }
+    for (unsigned i = 0; i < 65536; i++)
+        count_class_lookup16[i] = (count_class_lookup8[i >> 8] << 8) | count_class_lookup8[i & 0xff];
+
+    initialized = 1;
+
+}
+
+static inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919e3779f9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t hash_finish(const uint64_t acc[8], size_t lines) {
+    uint64_t h = lines * PRIME64_1;
+    for (unsigned i = 0; i < 8; i++)
+        h = (h ^ avalanche(acc[i])) * PRIME64_2;
+    return avalanche(h);
+}
+
+
+/* scalar kernels, on 64 bit words */
+
+static size_t classify_scalar(struct coverage_map* map) {
+
+    uint64_t* words = (uint64_t*) map->trace;
+    size_t lines = map->size / COVERAGE_LINE;
+    size_t dirty = 0;
+
+    for (size_t l = 0; l < lines; l++) {
+        uint64_t* w = words + l * 8;
+        if (!(w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]))
+            continue;
+
+        for (unsigned i = 0; i < 8; i++) {
+            if (!w[i])
+                continue;
+            uint16_t* h = (uint16_t*) &w[i];
+            h[0] = count_class_lookup16[h[0]];
+            h[1] = count_class_lookup16[h[1]];
+            h[2] = count_class_lookup16[h[2]];
+            h[3] = count_class_lookup16[h[3]];
+        }
+        map->dirty[dirty++] = l;
+    }
+    return map->dirty_count = dirty;
+
+}
+
+static int has_new_bits_scalar(struct coverage_map* map, uint8_t* virgin) {
+
+    int ret = 0;
+    for (size_t d = 0; d < map->dirty_count; d++) {
+        size_t offset = (size_t) map->dirty[d] * COVERAGE_LINE;
+        uint64_t* t = (uint64_t*) (map->trace + offset);
+        uint64_t* v = (uint64_t*) (virgin + offset);
+
+        for (unsigned i = 0; i < 8; i++) {
+            if (!(t[i] & v[i]))
+                continue;
+            if (ret < 2) {
+                uint8_t* tb = (uint8_t*) &t[i];
+                uint8_t* vb = (uint8_t*) &v[i];
+                ret = 1;
+                for (unsigned b = 0; b < 8; b++) {
+                    if (tb[b] && vb[b] == 0xff)
+                        ret = 2;
+                }
+            }
+            v[i] &= ~t[i];
+        }
+    }
+    return ret;
+
+}
+
+static uint64_t hash_scalar(struct coverage_map* map) {
+
+    uint64_t acc[8];
+    memcpy(acc, hash_init, sizeof(acc));
+
+    for (size_t d = 0; d < map->dirty_count; d++) {
+        uint64_t salt = (map->dirty[d] + 1ULL) * PRIME64_3;
+        uint64_t* w = (uint64_t*) (map->trace + (size_t) map->dirty[d] * COVERAGE_LINE);
+        uint64_t data[8];
+        memcpy(data, w, sizeof(data));
+
+        for (unsigned i = 0; i < 8; i++) {
+            uint64_t k = data[i] ^ hash_secret[i] ^ salt;
+            acc[i] += (k & 0xffffffff) * (k >> 32) + data[i ^ 1];
+        }
+    }
+    return hash_finish(acc, map->dirty_count);
+
+}
+
+
+#ifdef HAVE_X86
+
+/*
+ * Bucketing of 16 or 32 bytes with two nibble lookups: the high nibble gives
+ * the bucket of the counts above 15, the low one of the others.
+ */
+#define LUT_LO 0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16
+#define LUT_HI 0, 32, 64, 64, 64, 64, 64, 64, (char) 128, (char) 128, (char) 128, \
+               (char) 128, (char) 128, (char) 128, (char) 128, (char) 128
+
+__attribute__((target("avx2")))
+static inline __m256i classify_avx2_vec(__m256i v) {
+    const __m256i lut_lo = _mm256_setr_epi8(LUT_LO, LUT_LO);
+    const __m256i lut_hi = _mm256_setr_epi8(LUT_HI, LUT_HI);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i lo = _mm256_and_si256(v, nibble);
+    __m256i small = _mm256_cmpeq_epi8(hi, _mm256_setzero_si256());
+    return _mm256_or_si256(_mm256_shuffle_epi8(lut_hi, hi),
+                           _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo), small));
+}
+
+__attribute__((target("avx2")))
+static size_t classify_avx2(struct coverage_map* map) {
+
+    size_t lines = map->size / COVERAGE_LINE;
+    size_t dirty = 0;
+
+    for (size_t l = 0; l < lines; l++) {
+        __m256i* p = (__m256i*) (map->trace + l * COVERAGE_LINE);
+        __m256i v0 = _mm256_load_si256(p);
+        __m256i v1 = _mm256_load_si256(p + 1);
+        __m256i any = _mm256_or_si256(v0, v1);
+        if (_mm256_testz_si256(any, any))
+            continue;
+
+        _mm256_store_si256(p, classify_avx2_vec(v0));
+        _mm256_store_si256(p + 1, classify_avx2_vec(v1));
+        map->dirty[dirty++] = l;
+    }
+    return map->dirty_count = dirty;
+
+}
+
+__attribute__((target("avx2")))
+static int has_new_bits_avx2(struct coverage_map* map, uint8_t* virgin) {
+
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i zero = _mm256_setzero_si256();
+    int ret = 0;
+
+    for (size_t d = 0; d < map->dirty_count; d++) {
+        size_t offset = (size_t) map->dirty[d] * COVERAGE_LINE;
+        for (unsigned half = 0; half < 2; half++) {
+            __m256i* tp = (__m256i*) (map->trace + offset) + half;
+            __m256i* vp = (__m256i*) (virgin + offset) + half;
+            __m256i t = _mm256_load_si256(tp);
+            __m256i v = _mm256_loadu_si256(vp);
+            if (_mm256_testz_si256(t, v))
+                continue;
+
+            // a byte hit for the first time: virgin still 0xff, trace non zero
+            __m256i fresh = _mm256_andnot_si256(_mm256_cmpeq_epi8(t, zero), _mm256_cmpeq_epi8(v, ones));
+            ret = _mm256_movemask_epi8(fresh) ? 2 : ret > 1 ? ret : 1;
+            _mm256_storeu_si256(vp, _mm256_andnot_si256(t, v));
+        }
+    }
+    return ret;
+
+}
+
+__attribute__((target("avx2")))
+static uint64_t hash_avx2(struct coverage_map* map) {
+
+    __m256i acc0 = _mm256_loadu_si256((const __m256i*) hash_init);
+    __m256i acc1 = _mm256_loadu_si256((const __m256i*) hash_init + 1);
+    const __m256i secret0 = _mm256_loadu_si256((const __m256i*) hash_secret);
+    const __m256i secret1 = _mm256_loadu_si256((const __m256i*) hash_secret + 1);
+
+    for (size_t d = 0; d < map->dirty_count; d++) {
+        __m256i salt = _mm256_set1_epi64x((map->dirty[d] + 1ULL) * PRIME64_3);
+        __m256i* p = (__m256i*) (map->trace + (size_t) map->dirty[d] * COVERAGE_LINE);
+        __m256i d0 = _mm256_load_si256(p);
+        __m256i d1 = _mm256_load_si256(p + 1);
+
+        __m256i k0 = _mm256_xor_si256(d0, _mm256_xor_si256(secret0, salt));
+        __m256i k1 = _mm256_xor_si256(d1, _mm256_xor_si256(secret1, salt));
+        // low * high half of each key, plus the neighbouring data word
+        __m256i m0 = _mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32));
+        __m256i m1 = _mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(m0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2))));
+        acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(m1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+
+    uint64_t acc[8];
+    _mm256_storeu_si256((__m256i*) acc, acc0);
+    _mm256_storeu_si256((__m256i*) acc + 1, acc1);
+    return hash_finish(acc, map->dirty_count);
+
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i classify_ssse3_vec(__m128i v) {
+    const __m128i lut_lo = _mm_setr_epi8(LUT_LO);
+    const __m128i lut_hi = _mm_setr_epi8(LUT_HI);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    __m128i lo = _mm_and_si128(v, nibble);
+    __m128i small = _mm_cmpeq_epi8(hi, _mm_setzero_si128());
+    return _mm_or_si128(_mm_shuffle_epi8(lut_hi, hi),
+                        _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), small));
+}
+
+__attribute__((target("ssse3")))
+static size_t classify_ssse3(struct coverage_map* map) {
+
+    size_t lines = map->size / COVERAGE_LINE;
+    size_t dirty = 0;
+
+    for (size_t l = 0; l < lines; l++) {
+        __m128i* p = (__m128i*) (map->trace + l * COVERAGE_LINE);
+        __m128i v0 = _mm_load_si128(p), v1 = _mm_load_si128(p + 1);
+        __m128i v2 = _mm_load_si128(p + 2), v3 = _mm_load_si128(p + 3);
+        __m128i any = _mm_or_si128(_mm_or_si128(v0, v1), _mm_or_si128(v2, v3));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xffff)
+            continue;
+
+        _mm_store_si128(p, classify_ssse3_vec(v0));
+        _mm_store_si128(p + 1, classify_ssse3_vec(v1));
+        _mm_store_si128(p + 2, classify_ssse3_vec(v2));
+        _mm_store_si128(p + 3, classify_ssse3_vec(v3));
+        map->dirty[dirty++] = l;
+    }
+    return map->dirty_count = dirty;
+
+}
+
+/* SSE2 is enough for these two, they go with the SSSE3 kernel */
+
+static int has_new_bits_sse2(struct coverage_map* map, uint8_t* virgin) {
+
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i zero = _mm_setzero_si128();
+    int ret = 0;
+
+    for (size_t d = 0; d < map->dirty_count; d++) {
+        size_t offset = (size_t) map->dirty[d] * COVERAGE_LINE;
+        for (unsigned q = 0; q < 4; q++) {
+            __m128i* tp = (__m128i*) (map->trace + offset) + q;
+            __m128i* vp = (__m128i*) (virgin + offset) + q;
+            __m128i t = _mm_load_si128(tp);
+            __m128i v = _mm_loadu_si128(vp);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(t, v), zero)) == 0xffff)
+                continue;
+
+            __m128i fresh = _mm_andnot_si128(_mm_cmpeq_epi8(t, zero), _mm_cmpeq_epi8(v, ones));
+            ret = _mm_movemask_epi8(fresh) ? 2 : ret > 1 ? ret : 1;
+            _mm_storeu_si128(vp, _mm_andnot_si128(t, v));
+        }
+    }
+    return ret;
+
+}
+
+static uint64_t hash_sse2(struct coverage_map* map) {
+
+    __m128i acc[4], secret[4];
+    for (unsigned i = 0; i < 4; i++) {
+        acc[i] = _mm_loadu_si128((const __m128i*) hash_init + i);
+        secret[i] = _mm_loadu_si128((const __m128i*) hash_secret + i);
+    }
+
+    for (size_t d = 0; d < map->dirty_count; d++) {
+        __m128i salt = _mm_set1_epi64x((map->dirty[d] + 1ULL) * PRIME64_3);
+        __m128i* p = (__m128i*) (map->trace + (size_t) map->dirty[d] * COVERAGE_LINE);
+        for (unsigned i = 0; i < 4; i++) {
+            __m128i data = _mm_load_si128(p + i);
+            __m128i k = _mm_xor_si128(data, _mm_xor_si128(secret[i], salt));
+            __m128i m = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+            acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(m, _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))));
+        }
+    }
+
+    uint64_t out[8];
+    for (unsigned i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i*) out + i, acc[i]);
+    return hash_finish(out, map->dirty_count);
+
+}
+
+#endif
+
+
+int coverage_map_set_kernel(struct coverage_map* map, enum coverage_kernel kernel) {
+
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (kernel == COVERAGE_AVX2 && !__builtin_cpu_supports("avx2"))
+        return 0;
+    if (kernel == COVERAGE_SSSE3 && !__builtin_cpu_supports("ssse3"))
+        return 0;
+#else
+    if (kernel != COVERAGE_SCALAR)
+        return 0;
+#endif
+
+    map->kernel = kernel;
+    return 1;
+
+}
+
+int coverage_map_init(struct coverage_map* map, uint8_t* trace, size_t size) {
+
+    if (size % COVERAGE_LINE || (uintptr_t) trace % COVERAGE_LINE)
+        return -1;
+
+    init_lookup();
+
+    map->trace = trace;
+    map->size = size;
+    map->dirty_count = 0;
+    map->dirty = malloc(size / COVERAGE_LINE * sizeof(uint32_t));
+    if (!map->dirty)
+        return -1;
+    memset(trace, 0, size);
+
+    if (!coverage_map_set_kernel(map, COVERAGE_AVX2) && !coverage_map_set_kernel(map, COVERAGE_SSSE3))
+        coverage_map_set_kernel(map, COVERAGE_SCALAR);
+    return 0;
+
+}
+
+void coverage_map_destroy(struct coverage_map* map) {
+    free(map->dirty);
+    map->dirty = NULL;
+}
+
+size_t coverage_classify(struct coverage_map* map) {
+
+    switch (map->kernel) {
+#ifdef HAVE_X86
+    case COVERAGE_AVX2:
+        return classify_avx2(map);
+    case COVERAGE_SSSE3:
+        return classify_ssse3(map);
+#endif
+    default:
+        return classify_scalar(map);
+    }
+
+}
+
+int coverage_has_new_bits(struct coverage_map* map, uint8_t* virgin) {
+
+    switch (map->kernel) {
+#ifdef HAVE_X86
+    case COVERAGE_AVX2:
+        return has_new_bits_avx2(map, virgin);
+    case COVERAGE_SSSE3:
+        return has_new_bits_sse2(map, virgin);
+#endif
+    default:
+        return has_new_bits_scalar(map, virgin);
+    }
+
+}
+
+uint64_t coverage_hash(struct coverage_map* map) {
+
+    switch (map->kernel) {
+#ifdef HAVE_X86
+    case COVERAGE_AVX2:
+        return hash_avx2(map);
+    case COVERAGE_SSSE3:
+        return hash_sse2(map);
+#endif
+    default:
+        return hash_scalar(map);
+    }
+
+}
+
+void coverage_reset(struct coverage_map* map) {
+
+    for (size_t d = 0; d < map->dirty_count; d++)
+        memset(map->trace + (size_t) map->dirty[d] * COVERAGE_LINE, 0, COVERAGE_LINE);
+    map->dirty_count = 0;
+
+}
@@ -0,0 +1,48 @@
+#ifndef COVERAGE_MAP_H
+#define COVERAGE_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fuzzer side processing of the coverage map after each execution: the hit
+ * counts are bucketed in place, compared against the virgin map, hashed and
+ * cleared. Most of the map is zero, so coverage_classify() records which 64
+ * byte lines were touched and the other steps only visit those.
+ *
+ * The kernels use AVX2 or SSSE3 when the CPU has them, and give the same
+ * results (hash included) as the scalar fallback.
+ */
+
+#define COVERAGE_LINE 64
+
+enum coverage_kernel { COVERAGE_SCALAR, COVERAGE_SSSE3, COVERAGE_AVX2 };
+
+struct coverage_map {
+    uint8_t* trace;        /* COVERAGE_LINE aligned */
+    size_t size;           /* a multiple of COVERAGE_LINE */
+    uint32_t* dirty;       /* indexes of the lines coverage_classify() found non zero */
+    size_t dirty_count;
+    enum coverage_kernel kernel;
+};
+
+/* clears trace and picks the best kernel, returns non zero on failure */
+int coverage_map_init(struct coverage_map* map, uint8_t* trace, size_t size);
+void coverage_map_destroy(struct coverage_map* map);
+
+/* returns 0 if the CPU doesn't support the kernel */
+int coverage_map_set_kernel(struct coverage_map* map, enum coverage_kernel kernel);
+
+/* buckets the hit counts as afl-fuzz does, returns the number of dirty lines */
+size_t coverage_classify(struct coverage_map* map);
+
+/* 2 for a new edge, 1 for a new bucket of a known edge, 0 otherwise; virgin is updated */
+int coverage_has_new_bits(struct coverage_map* map, uint8_t* virgin);
+
+/* hash of the classified map, the path identity of the execution */
+uint64_t coverage_hash(struct coverage_map* map);
+
+/* clears the dirty lines, leaving the whole map zero */
+void coverage_reset(struct coverage_map* map);
+
+#endif
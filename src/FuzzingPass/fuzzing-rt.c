@@ -0,0 +1,627 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Coverage runtime of FuzzingPass, speaking the afl-fuzz protocol: the
+ * coverage map and the CmpLog table are attached from the shared memory
+ * segments afl-fuzz creates, and the forkserver hands it a fresh process per
+ * input, or resumes the same one in persistent mode.
+ */
+
+/* the map of the hashed block IDs, sequential IDs size it with __afl_final_loc */
+#define MAP_SIZE (1U << 16)
+/* longest history of FUZZING_COVERAGE=ngram-N */
+#define NGRAM_SIZE_MAX 8
+
+#define SHM_ENV_VAR "__AFL_SHM_ID"
+#define CMPLOG_SHM_ENV_VAR "__AFL_CMPLOG_SHM_ID"
+#define PERSIST_ENV_VAR "__AFL_PERSISTENT"
+#define DEFER_ENV_VAR "__AFL_DEFER_FORKSRV"
+
+#define FORKSRV_FD 198
+
+/* forkserver options of the hello message */
+#define FS_OPT_ENABLED 0x80000001
+#define FS_OPT_MAPSIZE 0x40000000
+#define FS_OPT_MAX_MAPSIZE ((0x00fffffeU >> 1) + 1)
+#define FS_OPT_SET_MAPSIZE(x) \
+    ((x) <= 1 || (x) > FS_OPT_MAX_MAPSIZE ? 0 : (((x) - 1) << 1))
+
+/* CmpLog table, with the layout of AFL++ 4.0x */
+#define CMP_MAP_W 65536
+#define CMP_MAP_H 32
+#define CMP_MAP_RTN_H (CMP_MAP_H / 2)
+
+#define CMP_TYPE_INS 1
+#define CMP_TYPE_RTN 2
+
+struct cmp_header {
+    unsigned hits : 24;
+    unsigned id : 24;
+    unsigned shape : 5;
+    unsigned type : 2;
+    unsigned attribute : 4;
+    unsigned overflow : 1;
+    unsigned reserved : 4;
+} __attribute__((packed));
+
+struct cmp_operands {
+    uint64_t v0;
+    uint64_t v1;
+    uint64_t v0_128;
+    uint64_t v1_128;
+} __attribute__((packed));
+
+struct cmpfn_operands {
+    uint8_t v0[31];
+    uint8_t v0_len;
+    uint8_t v1[31];
+    uint8_t v1_len;
+} __attribute__((packed));
+
+struct cmp_map {
+    struct cmp_header headers[CMP_MAP_W];
+    struct cmp_operands log[CMP_MAP_W][CMP_MAP_H];
+};
+
+/* where the coverage goes until the map is attached */
+static uint8_t __afl_area_initial[MAP_SIZE];
+
+uint8_t* __afl_area_ptr = __afl_area_initial;
+/* an array for the n-gram coverage, which keeps the last locations in it */
+__thread uint32_t __afl_prev_loc[NGRAM_SIZE_MAX] __attribute__((aligned(32)));
+__thread uint32_t __afl_prev_ctx;
+
+/* end of the slices handed to FUZZING_SEQUENTIAL_IDS modules, before our constructors run */
+uint32_t __afl_final_loc;
+uint32_t __afl_map_size = MAP_SIZE;
+
+/* null unless this is the comparison tracing run */
+struct cmp_map* __afl_cmp_map;
+
+static uint8_t* area_dummy;
+static int is_persistent;
+static int initialized;
+
+/*
+ * Each FUZZING_SEQUENTIAL_IDS executable or shared library registers its
+ * edge count in a constructor and gets a contiguous slice of the map, which
+ * it addresses through its own pointer. The runtime keeps those pointers in
+ * sync with __afl_area_ptr.
+ */
+#define MAX_MODULES 256
+#define NO_SLICE UINT32_MAX
+
+struct module_slice {
+    uint8_t** area;
+    uint32_t base;
+    uint32_t edges;
+};
+
+static struct module_slice modules[MAX_MODULES];
+static unsigned module_count;
+
+/* the size of __afl_area_ptr until the map is attached, then the map is fixed */
+static size_t area_capacity = MAP_SIZE;
+static int map_attached;
+
+/*
+ * FUZZING_THREADS=private: the threads started with pthread_create() once the
+ * map is attached count in maps of their own, of its final size, added into
+ * the shared map when they exit and at the end of each execution. For the
+ * other threads, the main one and those created by shared libraries included,
+ * the pointer stays null and the instrumentation counts in __afl_area_ptr.
+ */
+__thread uint8_t* __afl_thread_area_ptr;
+
+struct thread_map {
+    uint8_t* area;
+    size_t size;
+    struct thread_map* next;
+};
+
+static int private_maps;
+static struct thread_map* thread_maps;
+static pthread_mutex_t thread_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void set_area(uint8_t* area) {
+
+    __afl_area_ptr = area;
+    for (unsigned i = 0; i < module_count; i++) {
+        if (modules[i].base != NO_SLICE)
+            *modules[i].area = area + modules[i].base;
+    }
+
+}
+
+static uint8_t* map_private(size_t size) {
+
+    uint8_t* area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        perror("fuzzing-rt: mmap");
+        _exit(1);
+    }
+    return area;
+
+}
+
+/* returns the offset of the slice in the map */
+uint32_t __afl_register_module(uint8_t** area, uint32_t edges) {
+
+    if (module_count == MAX_MODULES) {
+        fprintf(stderr, "fuzzing-rt: more than %d instrumented modules\n", MAX_MODULES);
+        _exit(1);
+    }
+
+    struct module_slice* module = &modules[module_count++];
+    module->area = area;
+    module->edges = edges;
+
+    /* map[0] tells afl-fuzz that the target ran */
+    if (!__afl_final_loc)
+        __afl_final_loc = 1;
+
+    if (map_attached && __afl_final_loc + edges > __afl_map_size) {
+        /* dlopen()ed after the map was sized; with private thread maps its
+           counters overlap the first slices */
+        fprintf(stderr, "fuzzing-rt: no room in the map for a module of %u edges, its coverage is lost\n", edges);
+        module->base = NO_SLICE;
+        *area = map_private(edges ? edges : 1);
+        return 0;
+    }
+
+    module->base = __afl_final_loc;
+    __afl_final_loc += edges;
+
+    /* the coverage until the map is attached goes nowhere, but it must fit */
+    if (__afl_final_loc > area_capacity) {
+        uint8_t* old = __afl_area_ptr;
+        size_t old_capacity = area_capacity;
+        while (area_capacity < __afl_final_loc)
+            area_capacity *= 2;
+        set_area(map_private(area_capacity));
+        if (old != __afl_area_initial)
+            munmap(old, old_capacity);
+    }
+    else {
+        *area = __afl_area_ptr + module->base;
+    }
+    return module->base;
+
+}
+
+/*
+ * The threads get their maps from __wrap_pthread_create, which only replaces
+ * pthread_create when the executable is linked with -Wl,--wrap=pthread_create,
+ * as cc.py does with FUZZING_THREADS=private. The other modes leave
+ * pthread_create alone, and __real_pthread_create stays null.
+ */
+extern int __real_pthread_create(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*)
+    __attribute__((weak));
+
+void __afl_enable_private_maps() {
+    if (!__real_pthread_create) {
+        fprintf(stderr, "fuzzing-rt: FUZZING_THREADS=private needs the executable linked "
+                        "with -Wl,--wrap=pthread_create\n");
+        _exit(1);
+    }
+    private_maps = 1;
+}
+
+/* dst += src saturating at 255, clearing src */
+static void merge_map(uint8_t* dst, uint8_t* src, size_t size) {
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        __m128i s = _mm_loadu_si128((__m128i*) (src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) == 0xffff)
+            continue;
+        __m128i* d = (__m128i*) (dst + i);
+        _mm_storeu_si128(d, _mm_adds_epu8(_mm_loadu_si128(d), s));
+        _mm_storeu_si128((__m128i*) (src + i), zero);
+    }
+#endif
+    for (; i < size; i++) {
+        unsigned sum = dst[i] + src[i];
+        dst[i] = sum > 255 ? 255 : sum;
+        src[i] = 0;
+    }
+
+}
+
+/* the counts of a thread still running while this happens may be lost */
+static void merge_thread_maps() {
+
+    pthread_mutex_lock(&thread_maps_lock);
+    for (struct thread_map* map = thread_maps; map; map = map->next)
+        merge_map(__afl_area_ptr, map->area, map->size < __afl_map_size ? map->size : __afl_map_size);
+    pthread_mutex_unlock(&thread_maps_lock);
+
+}
+
+static void thread_exit(void* arg) {
+
+    struct thread_map* map = arg;
+    pthread_mutex_lock(&thread_maps_lock);
+    merge_map(__afl_area_ptr, map->area, map->size < __afl_map_size ? map->size : __afl_map_size);
+    for (struct thread_map** it = &thread_maps; *it; it = &(*it)->next) {
+        if (*it == map) {
+            *it = map->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&thread_maps_lock);
+
+    __afl_thread_area_ptr = NULL;
+    munmap(map->area, map->size);
+    free(map);
+
+}
+
+struct thread_start {
+    void* (*routine)(void*);
+    void* arg;
+};
+
+static void* thread_start(void* arg) {
+
+    struct thread_start start = *(struct thread_start*) arg;
+    free(arg);
+
+    struct thread_map* map = malloc(sizeof(*map));
+    if (!map) {
+        perror("fuzzing-rt: malloc");
+        _exit(1);
+    }
+    map->size = __afl_map_size;
+    map->area = map_private(map->size);
+
+    pthread_mutex_lock(&thread_maps_lock);
+    map->next = thread_maps;
+    thread_maps = map;
+    pthread_mutex_unlock(&thread_maps_lock);
+
+    void* ret;
+    __afl_thread_area_ptr = map->area;
+    pthread_cleanup_push(thread_exit, map);
+    ret = start.routine(start.arg);
+    pthread_cleanup_pop(1);
+    return ret;
+
+}
+
+int __wrap_pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*routine)(void*), void* arg) {
+
+    /* until the map is attached a registering module can still grow it, the
+       threads started before count in the shared map */
+    if (!private_maps || !map_attached)
+        return __real_pthread_create(thread, attr, routine, arg);
+
+    struct thread_start* start = malloc(sizeof(*start));
+    if (!start)
+        return EAGAIN;
+    start->routine = routine;
+    start->arg = arg;
+
+    int ret = __real_pthread_create(thread, attr, thread_start, start);
+    if (ret)
+        free(start);
+    return ret;
+
+}
+
+static void map_shm() {
+
+    if (__afl_final_loc)
+        __afl_map_size = (__afl_final_loc + 63) & ~63U;
+
+    /* afl-fuzz runs the target once with this to size its map */
+    if (getenv("AFL_DUMP_MAP_SIZE")) {
+        printf("%u\n", __afl_map_size);
+        exit(-1);
+    }
+
+    /* the coverage after the last persistent iteration goes nowhere */
+    area_dummy = map_private(__afl_map_size);
+    map_attached = 1;
+
+    const char* id = getenv(SHM_ENV_VAR);
+    if (id) {
+        void* area = shmat(atoi(id), NULL, 0);
+        if (area == (void*) -1) {
+            perror("fuzzing-rt: shmat");
+            _exit(1);
+        }
+        set_area(area);
+        /* tells afl-fuzz that the target ran, even if it hit nothing */
+        __afl_area_ptr[0] = 1;
+    }
+
+    const char* cmplog_id = getenv(CMPLOG_SHM_ENV_VAR);
+    if (cmplog_id) {
+        void* map = shmat(atoi(cmplog_id), NULL, 0);
+        if (map == (void*) -1) {
+            perror("fuzzing-rt: shmat");
+            _exit(1);
+        }
+        __afl_cmp_map = map;
+    }
+
+}
+
+/*
+ * afl-fuzz writes 4 bytes on FORKSRV_FD for each input, and reads the pid
+ * and then the wait status of the child on FORKSRV_FD + 1. In persistent
+ * mode the child stops itself after each iteration and is resumed instead of
+ * forked again.
+ */
+static void start_forkserver() {
+
+    uint32_t status = 0;
+    if (__afl_map_size <= FS_OPT_MAX_MAPSIZE)
+        status = FS_OPT_ENABLED | FS_OPT_MAPSIZE | FS_OPT_SET_MAPSIZE(__afl_map_size);
+
+    /* not running under afl-fuzz */
+    if (write(FORKSRV_FD + 1, &status, 4) != 4)
+        return;
+
+    pid_t child_pid = -1;
+    int child_stopped = 0;
+
+    while (1) {
+
+        uint32_t was_killed;
+        if (read(FORKSRV_FD, &was_killed, 4) != 4)
+            _exit(1);
+
+        /* afl-fuzz killed the stopped child on a timeout, reap it */
+        if (child_stopped && was_killed) {
+            child_stopped = 0;
+            if (waitpid(child_pid, (int*) &status, 0) < 0)
+                _exit(1);
+        }
+
+        if (!child_stopped) {
+            child_pid = fork();
+            if (child_pid < 0)
+                _exit(1);
+
+            if (!child_pid) {
+                close(FORKSRV_FD);
+                close(FORKSRV_FD + 1);
+                return;
+            }
+        }
+        else {
+            kill(child_pid, SIGCONT);
+            child_stopped = 0;
+        }
+
+        if (write(FORKSRV_FD + 1, &child_pid, 4) != 4)
+            _exit(1);
+
+        if (waitpid(child_pid, (int*) &status, is_persistent ? WUNTRACED : 0) < 0)
+            _exit(1);
+
+        if (WIFSTOPPED(status))
+            child_stopped = 1;
+
+        if (write(FORKSRV_FD + 1, &status, 4) != 4)
+            _exit(1);
+    }
+
+}
+
+/* __AFL_INIT(): the forkserver starts here instead of before main */
+void __afl_manual_init() {
+
+    if (initialized)
+        return;
+    initialized = 1;
+
+    start_forkserver();
+
+}
+
+/*
+ * __AFL_LOOP(max): returns 1 max times, with the coverage of the previous
+ * iteration already collected by afl-fuzz
+ */
+int __afl_persistent_loop(unsigned int max_cnt) {
+
+    static int first_pass = 1;
+    static unsigned int cycle_cnt;
+
+    if (first_pass) {
+        /* the code before the loop ran once for all the iterations */
+        if (is_persistent) {
+            memset(__afl_area_ptr, 0, __afl_map_size);
+            __afl_area_ptr[0] = 1;
+            memset(__afl_prev_loc, 0, sizeof(__afl_prev_loc));
+        }
+        cycle_cnt = max_cnt;
+        first_pass = 0;
+        return 1;
+    }
+
+    if (is_persistent && --cycle_cnt) {
+        merge_thread_maps();
+        raise(SIGSTOP);
+        __afl_area_ptr[0] = 1;
+        memset(__afl_prev_loc, 0, sizeof(__afl_prev_loc));
+        return 1;
+    }
+
+    merge_thread_maps();
+    set_area(area_dummy);
+    return 0;
+
+}
+
+// the priorities below 100 are reserved for us, the runtime, and the
+// constructor setting __afl_final_loc runs at 0
+#pragma GCC diagnostic ignored "-Wprio-ctor-dtor"
+
+__attribute__((constructor(1))) static void auto_early() {
+
+    is_persistent = getenv(PERSIST_ENV_VAR) != NULL;
+    map_shm();
+
+}
+
+/* the last execution, or the only one */
+__attribute__((destructor)) static void auto_fini() {
+
+    if (private_maps)
+        merge_thread_maps();
+
+}
+
+__attribute__((constructor(5))) static void auto_init() {
+
+    if (getenv(DEFER_ENV_VAR))
+        return;
+    __afl_manual_init();
+
+}
+
+/*
+ * CmpLog hooks, called by FUZZING_CMPLOG programs only when __afl_cmp_map is
+ * attached. The entry is picked by the address of the comparison.
+ */
+
+static inline uintptr_t cmp_key(uintptr_t pc) {
+    return ((pc >> 4) ^ (pc << 8)) & (CMP_MAP_W - 1);
+}
+
+static inline __attribute__((always_inline))
+void log_ins(uintptr_t pc, uint64_t arg1, uint64_t arg2, uint64_t arg1_128,
+             uint64_t arg2_128, uint8_t attr, unsigned shape) {
+
+    uintptr_t k = cmp_key(pc);
+    struct cmp_header* header = &__afl_cmp_map->headers[k];
+    unsigned hits;
+
+    if (header->type != CMP_TYPE_INS) {
+        header->type = CMP_TYPE_INS;
+        header->hits = 1;
+        header->shape = shape;
+        hits = 0;
+    }
+    else {
+        hits = header->hits++;
+        if (header->shape < shape)
+            header->shape = shape;
+    }
+    header->attribute = attr;
+
+    struct cmp_operands* log = &__afl_cmp_map->log[k][hits & (CMP_MAP_H - 1)];
+    log->v0 = arg1;
+    log->v1 = arg2;
+    log->v0_128 = arg1_128;
+    log->v1_128 = arg2_128;
+
+}
+
+void __cmplog_ins_hook1(uint8_t arg1, uint8_t arg2, uint8_t attr) {
+    if (__afl_cmp_map)
+        log_ins((uintptr_t) __builtin_return_address(0), arg1, arg2, 0, 0, attr, 0);
+}
+
+void __cmplog_ins_hook2(uint16_t arg1, uint16_t arg2, uint8_t attr) {
+    if (__afl_cmp_map)
+        log_ins((uintptr_t) __builtin_return_address(0), arg1, arg2, 0, 0, attr, 1);
+}
+
+void __cmplog_ins_hook4(uint32_t arg1, uint32_t arg2, uint8_t attr) {
+    if (__afl_cmp_map)
+        log_ins((uintptr_t) __builtin_return_address(0), arg1, arg2, 0, 0, attr, 3);
+}
+
+void __cmplog_ins_hook8(uint64_t arg1, uint64_t arg2, uint8_t attr) {
+    if (__afl_cmp_map)
+        log_ins((uintptr_t) __builtin_return_address(0), arg1, arg2, 0, 0, attr, 7);
+}
+
+/* size is the width of the operands in bytes, minus one */
+void __cmplog_ins_hookN(__uint128_t arg1, __uint128_t arg2, uint8_t attr, uint8_t size) {
+    if (__afl_cmp_map)
+        log_ins((uintptr_t) __builtin_return_address(0), (uint64_t) arg1, (uint64_t) arg2,
+                (uint64_t) (arg1 >> 64), (uint64_t) (arg2 >> 64), attr, size);
+}
+
+/*
+ * The routine hooks run right before the comparison itself, which reads the
+ * same bytes, so they only bound the copy by the length and the terminator.
+ */
+static inline __attribute__((always_inline))
+void log_rtn(uintptr_t pc, const uint8_t* ptr1, size_t len1, const uint8_t* ptr2, size_t len2) {
+
+    uintptr_t k = cmp_key(pc);
+    struct cmp_header* header = &__afl_cmp_map->headers[k];
+    unsigned hits;
+
+    if (len1 > 31)
+        len1 = 31;
+    if (len2 > 31)
+        len2 = 31;
+    size_t len = len1 > len2 ? len1 : len2;
+    if (!len)
+        return;
+
+    if (header->type != CMP_TYPE_RTN) {
+        header->type = CMP_TYPE_RTN;
+        header->hits = 1;
+        header->shape = len - 1;
+        hits = 0;
+    }
+    else {
+        hits = header->hits++;
+        if (header->shape < len - 1)
+            header->shape = len - 1;
+    }
+
+    struct cmpfn_operands* log =
+        &((struct cmpfn_operands*) __afl_cmp_map->log[k])[hits & (CMP_MAP_RTN_H - 1)];
+    memcpy(log->v0, ptr1, len1);
+    log->v0_len = len1;
+    memcpy(log->v1, ptr2, len2);
+    log->v1_len = len2;
+
+}
+
+void __cmplog_rtn_hook_n(const uint8_t* ptr1, const uint8_t* ptr2, uint64_t len) {
+    if (__afl_cmp_map)
+        log_rtn((uintptr_t) __builtin_return_address(0), ptr1, len, ptr2, len);
+}
+
+void __cmplog_rtn_hook_strn(const uint8_t* ptr1, const uint8_t* ptr2, uint64_t len) {
+    if (__afl_cmp_map) {
+        size_t max = len < 31 ? len : 31;
+        log_rtn((uintptr_t) __builtin_return_address(0), ptr1, strnlen((const char*) ptr1, max),
+                ptr2, strnlen((const char*) ptr2, max));
+    }
+}
+
+void __cmplog_rtn_hook_str(const uint8_t* ptr1, const uint8_t* ptr2) {
+    if (__afl_cmp_map)
+        log_rtn((uintptr_t) __builtin_return_address(0), ptr1, strnlen((const char*) ptr1, 31),
+                ptr2, strnlen((const char*) ptr2, 31));
+}
@@ -1,27 +1,170 @@
 #include "llvm/Pass.h"
+#include "llvm/Analysis/CFG.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
+#include <cstdlib>
+#include <memory>
+
+#ifdef SECURITY_PLUGIN
+#include "Plugin.h"
+#endif
+
 using namespace llvm;
 
+/*
+ * Census of the module, to size the other passes before running them: the
+ * blocks and edges give the coverage map size, the pointer values, loads,
+ * stores and calls the nodes and constraints of the Anderson solver and the
+ * checks of LearnSanitizer. One walk over the instructions, plus a DFS per
+ * function for the loops, counted as the targets of back edges.
+ *
+ * Written as one JSON object per module, to stderr or appended to the file
+ * in HELLO_OUTPUT; HELLO_FUNCTIONS adds the counts of every function.
+ */
+
 namespace {
+struct Census {
+  uint64_t Functions = 0, Blocks = 0, Edges = 0, Instructions = 0, Loads = 0,
+           Stores = 0, PointerValues = 0, DirectCalls = 0, IndirectCalls = 0,
+           Loops = 0;
+
+  void add(const Census &Other) {
+    Functions += Other.Functions;
+    Blocks += Other.Blocks;
+    Edges += Other.Edges;
+    Instructions += Other.Instructions;
+    Loads += Other.Loads;
+    Stores += Other.Stores;
+    PointerValues += Other.PointerValues;
+    DirectCalls += Other.DirectCalls;
+    IndirectCalls += Other.IndirectCalls;
+    Loops += Other.Loops;
+  }
+
+  void write(json::OStream &J) const {
+    J.attribute("blocks", Blocks);
+    J.attribute("edges", Edges);
+    J.attribute("instructions", Instructions);
+    J.attribute("loads", Loads);
+    J.attribute("stores", Stores);
+    J.attribute("pointer_values", PointerValues);
+    J.attribute("direct_calls", DirectCalls);
+    J.attribute("indirect_calls", IndirectCalls);
+    J.attribute("loops", Loops);
+  }
+};
+
+static Census countFunction(Function &F) {
+  Census C;
+  C.Functions = 1;
+  for (Argument &A : F.args())
+    C.PointerValues += A.getType()->isPointerTy();
+
+  for (BasicBlock &BB : F) {
+    C.Blocks++;
+    C.Edges += BB.getTerminator() ? BB.getTerminator()->getNumSuccessors() : 0;
+    for (Instruction &I : BB) {
+      C.Instructions++;
+      C.PointerValues += I.getType()->isPointerTy();
+      if (isa<LoadInst>(I))
+        C.Loads++;
+      else if (isa<StoreInst>(I))
+        C.Stores++;
+      else if (CallBase *CB = dyn_cast<CallBase>(&I)) {
+        if (isa<IntrinsicInst>(CB))
+          continue;
+        if (CB->getCalledFunction())
+          C.DirectCalls++;
+        else if (!CB->isInlineAsm())
+          C.IndirectCalls++;
+      }
+    }
+  }
+
+  SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 8> BackEdges;
+  FindFunctionBackedges(F, BackEdges);
+  SmallPtrSet<const BasicBlock *, 8> Headers;
+  for (auto &Edge : BackEdges)
+    Headers.insert(Edge.second);
+  C.Loops = Headers.size();
+  return C;
+}
+
 struct Hello : public ModulePass {
   static char ID;
   Hello() : ModulePass(ID) {}
 
   bool runOnModule(Module &M) override {
-    errs() << "Hello: \n";
-    //errs().write_escaped(F.getName()) << '\n';
+    bool PerFunction = getenv("HELLO_FUNCTIONS") != nullptr;
+
+    std::unique_ptr<raw_fd_ostream> File;
+    if (const char *Path = getenv("HELLO_OUTPUT")) {
+      std::error_code EC;
+      File.reset(new raw_fd_ostream(Path, EC, sys::fs::OF_Append | sys::fs::OF_Text));
+      if (EC)
+        report_fatal_error(Twine("Hello: cannot open HELLO_OUTPUT: ") + EC.message());
+    }
+    raw_ostream &OS = File ? *File : errs();
+
+    Census Total;
+    uint64_t PointerGlobals = 0;
+    for (GlobalVariable &GV : M.globals())
+      PointerGlobals += GV.getValueType()->isPointerTy();
+
+    json::OStream J(OS);
+    J.objectBegin();
+    J.attribute("module", M.getName());
+    if (PerFunction) {
+      J.attributeBegin("functions");
+      J.arrayBegin();
+    }
+    for (Function &F : M) {
+      if (F.isDeclaration())
+        continue;
+      Census C = countFunction(F);
+      Total.add(C);
+      if (PerFunction) {
+        J.objectBegin();
+        J.attribute("name", F.getName());
+        C.write(J);
+        J.objectEnd();
+      }
+    }
+    if (PerFunction) {
+      J.arrayEnd();
+      J.attributeEnd();
+    }
+
+    J.attribute("functions_defined", Total.Functions);
+    J.attribute("globals", uint64_t(M.global_size()));
+    J.attribute("pointer_globals", PointerGlobals);
+    Total.write(J);
+    J.objectEnd();
+    OS << "\n";
     return false;
   }
 }; // end of struct Hello
 }  // end of anonymous namespace
 
 char Hello::ID = 0;
+
+#ifdef SECURITY_PLUGIN
+PreservedAnalyses HelloPass::run(Module &M, ModuleAnalysisManager &) {
+  Hello().runOnModule(M);
+  return PreservedAnalyses::all();
+}
+#else
 static RegisterPass<Hello> X("hello", "Hello World Pass",
                              false /* Only looks at CFG */,
                              false /* Analysis Pass */);
@@ -30,3 +173,4 @@ static RegisterStandardPasses Y(
     PassManagerBuilder::EP_EarlyAsPossible,
     [](const PassManagerBuilder &Builder,
        legacy::PassManagerBase &PM) { PM.add(new Hello()); });
+#endif
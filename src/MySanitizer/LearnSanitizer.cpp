@@ -8,13 +8,32 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/SourceMgr.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
-
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <set>
 #include <vector>
 
+#include "Anderson.h"
+#include "FunctionFilter.h"
+#include "InstructionIndex.h"
+#ifdef SECURITY_PLUGIN
+#include "Plugin.h"
+#endif
+
 //#define DEBUG 1
 
 #ifdef DEBUG
@@ -29,6 +48,103 @@
 using namespace llvm;
 using namespace std;
 
+// shadow byte values of the stack redzones, as in learnsan.h
+static const uint8_t kStackLeftRZ = 0xf1;
+static const uint8_t kStackMidRZ = 0xf2;
+static const uint8_t kStackRightRZ = 0xf3;
+
+// shadow mapping of the runtime, the scale can be changed with
+// LEARNSAN_SHADOW_SCALE (3 to 6) and must match the one it was built with
+static const uint64_t kShadowOffset = 0x7fff8000;
+static const uint64_t kDefaultShadowScale = 3;
+
+// libc functions redirected to a __hook_ replacement that range checks them
+static bool isIntercepted(StringRef Name) {
+
+    static const char *Intercepted[] = {
+
+        "memcpy", "memmove", "memset", "memcmp", "strlen", "strnlen",
+        "strcpy", "strncpy", "strcat", "strncat", "strcmp", "strncmp"
+
+    };
+
+    for (auto const &InterceptedFunc : Intercepted) {
+
+      if (Name == InterceptedFunc) return true;
+
+    }
+
+    return false;
+
+}
+
+// Allocation functions served by the runtime allocator, with the __hook_
+// that replaces them, or null. The C++ operators are matched by their Itanium
+// mangled names, new[] and delete[] share the hooks of new and delete.
+static const char* getHeapHook(StringRef Name) {
+
+    static const pair<const char*, const char*> HeapFunctions[] = {
+
+        {"malloc", "__hook_malloc"}, {"free", "__hook_free"},
+        {"calloc", "__hook_calloc"}, {"realloc", "__hook_realloc"},
+        {"posix_memalign", "__hook_posix_memalign"}, {"memalign", "__hook_memalign"},
+        {"aligned_alloc", "__hook_aligned_alloc"},
+        {"strdup", "__hook_strdup"}, {"strndup", "__hook_strndup"},
+
+        {"_Znwm", "__hook_new"}, {"_Znam", "__hook_new"},
+        {"_ZnwmRKSt9nothrow_t", "__hook_new_nothrow"},
+        {"_ZnamRKSt9nothrow_t", "__hook_new_nothrow"},
+        {"_ZnwmSt11align_val_t", "__hook_new_aligned"},
+        {"_ZnamSt11align_val_t", "__hook_new_aligned"},
+        {"_ZnwmSt11align_val_tRKSt9nothrow_t", "__hook_new_aligned_nothrow"},
+        {"_ZnamSt11align_val_tRKSt9nothrow_t", "__hook_new_aligned_nothrow"},
+
+        {"_ZdlPv", "__hook_delete"}, {"_ZdaPv", "__hook_delete"},
+        {"_ZdlPvm", "__hook_delete_sized"}, {"_ZdaPvm", "__hook_delete_sized"},
+        {"_ZdlPvSt11align_val_t", "__hook_delete_aligned"},
+        {"_ZdaPvSt11align_val_t", "__hook_delete_aligned"},
+        {"_ZdlPvmSt11align_val_t", "__hook_delete_sized_aligned"},
+        {"_ZdaPvmSt11align_val_t", "__hook_delete_sized_aligned"},
+        {"_ZdlPvRKSt9nothrow_t", "__hook_delete_nothrow"},
+        {"_ZdaPvRKSt9nothrow_t", "__hook_delete_nothrow"},
+        {"_ZdlPvSt11align_val_tRKSt9nothrow_t", "__hook_delete_aligned_nothrow"},
+        {"_ZdaPvSt11align_val_tRKSt9nothrow_t", "__hook_delete_aligned_nothrow"}
+
+    };
+
+    for (auto const &HeapFunc : HeapFunctions) {
+
+      if (Name == HeapFunc.first) return HeapFunc.second;
+
+    }
+
+    return nullptr;
+
+}
+
+// Size in bytes of a stack or global object, false if it isn't known statically
+static bool getObjectSize(const Value* Object, const DataLayout& DL, uint64_t& Size) {
+
+    if (const AllocaInst* AI = dyn_cast<AllocaInst>(Object)) {
+        const ConstantInt* Count = dyn_cast<ConstantInt>(AI->getArraySize());
+        if (!Count)
+            return false;
+        Size = DL.getTypeAllocSize(AI->getAllocatedType()).getFixedSize() * Count->getZExtValue();
+        return true;
+    }
+
+    if (const GlobalVariable* GV = dyn_cast<GlobalVariable>(Object)) {
+        // a weak definition may be replaced by a smaller one at link time
+        if (!GV->hasDefinitiveInitializer() && !GV->isDeclaration())
+            return false;
+        Size = DL.getTypeAllocSize(GV->getValueType()).getFixedSize();
+        return true;
+    }
+
+    return false;
+
+}
+
 static bool isBlacklisted(const Function& F) {
 
     static const char *Blacklist[] = {
@@ -53,8 +169,8 @@ static bool isBlacklisted(const Function& F) {
 struct LearnSanitizerModulePass : public ModulePass {
   private:
 
-    FunctionCallee hook_load, hook_store, hook_malloc, 
-                   hook_free, hook_entry, hook_exit;
+    FunctionCallee hook_load, hook_store, hook_entry, hook_exit,
+                   hook_load_range, hook_store_range, hook_no_return;
 
 	LLVMContext* C;
 
@@ -63,48 +179,516 @@ struct LearnSanitizerModulePass : public ModulePass {
 
     DataLayout* Layout;
 
-    void ReplaceHeapFunctions(vector<CallInst*>& HeapFunctions, FunctionCallee& SanitizerFunction) {    
-        for (CallInst* Call : HeapFunctions) {
-            
-            Call->setCalledFunction(SanitizerFunction);
+    // LEARNSAN_SAMPLING: every check is guarded by a per-thread countdown
+    bool SamplingMode;
+    GlobalVariable* SampleCounter;
+
+    // LEARNSAN_NO_ELIDE turns off the points-to based check elision
+    bool ElideChecks;
+
+    // LEARNSAN_NO_STACK and LEARNSAN_NO_GLOBALS turn off the redzones around
+    // stack and global objects
+    bool InstrumentStack, InstrumentGlobalVars;
+    size_t StackObjects;
+
+    // LEARNSAN_INLINE_RT=<path of learnsan-rt.bc> inlines the sized checks
+    const char* InlineRuntimePath;
+
+    // log2 of the bytes described by a shadow byte, see learnsan.h
+    uint64_t ShadowScale;
+    uint64_t MinRedzone;
+    Function* ModuleCtor;
+
+    // LEARNSAN_ALLOWLIST, LEARNSAN_DENYLIST, LEARNSAN_PROFILE and LEARNSAN_DIFF:
+    // the functions left out get no checks, but their heap calls still go
+    // through the hooks, the allocations are shared
+    FunctionFilter Filter;
+
+    // name strings passed to __hook_entry/__hook_exit
+    map<Function*, Value*> FunctionNames;
+
+
+    // An access can't hit a redzone when its pointer can only point to stack
+    // or global objects and the constant offset plus the access size stays
+    // inside every one of them
+    bool isProvablySafe(Value* Ptr, uint64_t Size, AndersonAnalysisModulePass& Anderson) {
+        APInt Offset(Layout->getIndexTypeSizeInBits(Ptr->getType()), 0);
+        Value* Base = Ptr->stripAndAccumulateConstantOffsets(*Layout, Offset, true);
+        if (Offset.isNegative())
+            return false;
+        uint64_t End = Offset.getZExtValue() + Size;
+
+        vector<const Value*> Objects;
+        if (isa<AllocaInst>(Base) || isa<GlobalVariable>(Base))
+            Objects.push_back(Base);
+        else if (!Anderson.getNonHeapObjects(Base, Objects))
+            return false;
+
+        for (const Value* Object : Objects) {
+            uint64_t ObjectSize;
+            if (!getObjectSize(Object, *Layout, ObjectSize) || End > ObjectSize)
+                return false;
         }
+        return true;
     }
 
+    size_t ElideSafeAccesses(vector<Instruction*>& Accesses, AndersonAnalysisModulePass& Anderson) {
+        size_t before = Accesses.size();
+        Accesses.erase(remove_if(Accesses.begin(), Accesses.end(), [&](Instruction* Access) {
+            Value* Ptr = getLoadStorePointerOperand(Access);
+            Type* AccessType = isa<StoreInst>(Access) ? cast<StoreInst>(Access)->getValueOperand()->getType()
+                                                      : Access->getType();
+            TypeSize Size = Layout->getTypeStoreSize(AccessType);
+            return !Size.isScalable() && isProvablySafe(Ptr, Size.getFixedSize(), Anderson);
+        }), Accesses.end());
+        return before - Accesses.size();
+    }
+
+
+    // In sampling mode the hook only runs when the countdown expires, and then
+    // the __hook_sampled_ variant rearms the counter before checking
+    CallInst* CreateCheck(Instruction* InsertBefore, Module& M, FunctionCallee Hook, ArrayRef<Value*> Args) {
+        IRBuilder<> IRB(InsertBefore);
 
-    void InstrumentMemoryAccesses(vector<Instruction*>& Accesses, Module& M, FunctionCallee SanitizerFunction) {
+        if (SamplingMode) {
+            LoadInst* Counter = IRB.CreateLoad(Int32Ty, SampleCounter);
+            Value* Next = IRB.CreateSub(Counter, ConstantInt::get(Int32Ty, 1));
+            StoreInst* Update = IRB.CreateStore(Next, SampleCounter);
+            Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+            Update->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+
+            Value* Expired = IRB.CreateICmpSLE(Next, ConstantInt::get(Int32Ty, 0));
+            Instruction* Then = SplitBlockAndInsertIfThen(Expired, InsertBefore, false,
+                                    MDBuilder(*C).createBranchWeights(1, 1000));
+            IRB.SetInsertPoint(Then);
+
+            StringRef Name = Hook.getCallee()->getName();
+            Hook = M.getOrInsertFunction(("__hook_sampled_" + Name.substr(strlen("__hook_"))).str(),
+                                         Hook.getFunctionType());
+        }
+
+        CallInst* hook = IRB.CreateCall(Hook, Args);
+        hook->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+        return hook;
+    }
+
+    // the hooks take the prototype of the call, invokes of operator new included
+    void ReplaceHeapFunctions(vector<CallBase*>& HeapFunctions, Module& M) {
+        for (CallBase* Call : HeapFunctions) {
+            const char* HookName = getHeapHook(Call->getCalledFunction()->getName());
+            Call->setCalledFunction(M.getOrInsertFunction(HookName, Call->getFunctionType()));
+        }
+    }
+
+
+    void ReplaceInterceptedFunctions(vector<CallBase*>& Calls, Module& M) {
+        for (CallBase* Call : Calls) {
+            string HookName = "__hook_" + Call->getCalledFunction()->getName().str();
+            Call->setCalledFunction(M.getOrInsertFunction(HookName, Call->getFunctionType()));
+        }
+    }
+
+
+    // Accesses of 1, 2, 4 or 8 bytes go to the sized hook, vectors and odd sizes
+    // are checked as a range
+    void InstrumentMemoryAccesses(vector<Instruction*>& Accesses, Module& M,
+                                  FunctionCallee SanitizerFunction, FunctionCallee RangeFunction) {
 
 	    for (Instruction* Access : Accesses) {
             vector<Value*> args;
             Value* memoryPointer = nullptr;
-            if (StoreInst* ST = dyn_cast<StoreInst>(Access))
+            Type* accessType = nullptr;
+            if (StoreInst* ST = dyn_cast<StoreInst>(Access)) {
                 memoryPointer = ST->getPointerOperand();
-            else if (LoadInst* LO = dyn_cast<LoadInst>(Access))
+                accessType = ST->getValueOperand()->getType();
+            }
+            else if (LoadInst* LO = dyn_cast<LoadInst>(Access)) {
                 memoryPointer = LO->getPointerOperand();
+                accessType = LO->getType();
+            }
 
+            TypeSize storeSize = Layout->getTypeStoreSize(accessType);
+            if (storeSize.isScalable())
+                continue;
 
-            PointerType* pointerType = cast<PointerType>(memoryPointer->getType());                         
-            uint64_t storeSize = Layout->getTypeStoreSize(pointerType->getPointerElementType());
-            Constant* Size = ConstantInt::get(pointerType->getPointerElementType(), storeSize);
+            uint64_t size = storeSize.getFixedSize();
+            bool isSized = size == 1 || size == 2 || size == 4 || size == 8;
             
             IRBuilder<> IRB(Access);
-            args.push_back(memoryPointer);
-            args.push_back(Size);
-            CallInst* hook = IRB.CreateCall(SanitizerFunction, args);
-	    	hook->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(*C, None));
+            args.push_back(IRB.CreatePtrToInt(memoryPointer, Int64Ty));
+            args.push_back(ConstantInt::get(Int64Ty, size));
+            CreateCheck(Access, M, isSized ? SanitizerFunction : RangeFunction, args);
 	    }
     }
 
 
+    void InstrumentMemIntrinsics(vector<MemIntrinsic*>& Intrinsics, Module& M) {
+
+        for (MemIntrinsic* MI : Intrinsics) {
+            IRBuilder<> IRB(MI);
+            Value* Length = IRB.CreateZExtOrTrunc(MI->getLength(), Int64Ty);
+
+            // CreateCheck may split the block, so build every operand first
+            Value* Dest = IRB.CreatePtrToInt(MI->getRawDest(), Int64Ty);
+
+            if (MemTransferInst* MT = dyn_cast<MemTransferInst>(MI)) {
+                Value* Source = IRB.CreatePtrToInt(MT->getRawSource(), Int64Ty);
+                CreateCheck(MI, M, hook_load_range, {Source, Length});
+            }
+
+            CreateCheck(MI, M, hook_store_range, {Dest, Length});
+        }
+    }
+
+
+    uint64_t getRedzoneSize(uint64_t Size) {
+        // a quarter of the object, bounded, and the object plus its redzone
+        // always a multiple of MinRedzone
+        uint64_t RZ = max(MinRedzone, min(Size / 4, (uint64_t)1 << 18));
+        return alignTo(Size + RZ, MinRedzone) - Size;
+    }
+
+    // Scalars that are only loaded and stored as a whole can't be overflowed,
+    // so they stay out of the frame and cost nothing
+    bool isInterestingAlloca(AllocaInst* AI) {
+        uint64_t Size;
+        if (!AI->isStaticAlloca() || AI->isSwiftError() || AI->isUsedWithInAlloca() ||
+            !getObjectSize(AI, *Layout, Size) || Size == 0)
+            return false;
+
+        for (User* U : AI->users()) {
+            if (LoadInst* LI = dyn_cast<LoadInst>(U)) {
+                if (LI->getType() == AI->getAllocatedType())
+                    continue;
+            }
+            else if (StoreInst* SI = dyn_cast<StoreInst>(U)) {
+                if (SI->getPointerOperand() == AI &&
+                    SI->getValueOperand()->getType() == AI->getAllocatedType())
+                    continue;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    static void eraseLifetimeMarkers(Value* V) {
+        vector<Instruction*> Dead;
+        for (User* U : V->users()) {
+            if (IntrinsicInst* II = dyn_cast<IntrinsicInst>(U)) {
+                if (II->getIntrinsicID() == Intrinsic::lifetime_start ||
+                    II->getIntrinsicID() == Intrinsic::lifetime_end)
+                    Dead.push_back(II);
+            }
+            else if (isa<BitCastInst>(U))
+                eraseLifetimeMarkers(U);
+        }
+        for (Instruction* I : Dead)
+            I->eraseFromParent();
+    }
+
+    static Instruction* getFirstNonAlloca(BasicBlock& BB) {
+        BasicBlock::iterator It = BB.getFirstInsertionPt();
+        while (isa<AllocaInst>(*It))
+            ++It;
+        return &*It;
+    }
+
+    // Writes the shadow of a frame with 8 (or 4) shadow bytes per store and
+    // skips the chunks that are already clean
+    size_t StoreShadow(IRBuilder<>& IRB, Value* ShadowBase, const vector<uint8_t>& Shadow,
+                       const vector<uint8_t>& Pattern) {
+        size_t Stores = 0;
+        for (size_t i = 0; i < Shadow.size(); ) {
+            size_t Width = 8;
+            while (Width > Shadow.size() - i)
+                Width /= 2;
+            uint64_t Bits = 0, Poisoned = 0;
+            for (size_t j = 0; j < Width; j++) {
+                size_t Byte = Layout->isLittleEndian() ? j : Width - 1 - j;
+                Bits |= (uint64_t) Pattern[i + j] << (8 * Byte);
+                Poisoned |= Shadow[i + j];
+            }
+
+            if (Poisoned) {
+                Type* Ty = IntegerType::get(*C, 8 * Width);
+                Value* Addr = i ? IRB.CreateAdd(ShadowBase, ConstantInt::get(Int64Ty, i)) : ShadowBase;
+                Addr = IRB.CreateIntToPtr(Addr, PointerType::get(Ty, 0));
+                StoreInst* ST = IRB.CreateAlignedStore(ConstantInt::get(Ty, Bits), Addr, Align(1));
+                ST->setMetadata("nosanitize", MDNode::get(*C, None));
+                Stores++;
+            }
+            i += Width;
+        }
+        return Stores;
+    }
+
+    // Merges the interesting allocas of F into one frame, every object
+    // followed by a redzone. The redzones are poisoned at entry and cleared
+    // before each return, the number of shadow stores is the per call cost.
+    size_t InstrumentStackFrame(Function& F) {
+        if (F.hasFnAttribute(Attribute::Naked) || F.callsFunctionThatReturnsTwice())
+            return 0;
+
+        vector<AllocaInst*> Allocas;
+        vector<ReturnInst*> Returns;
+        for (BasicBlock& BB : F) {
+            for (Instruction& I : BB) {
+                if (AllocaInst* AI = dyn_cast<AllocaInst>(&I)) {
+                    if (isInterestingAlloca(AI))
+                        Allocas.push_back(AI);
+                }
+                else if (ReturnInst* RI = dyn_cast<ReturnInst>(&I))
+                    Returns.push_back(RI);
+                else if (CallInst* CI = dyn_cast<CallInst>(&I)) {
+                    // nothing can run between a musttail call and the return
+                    if (CI->isMustTailCall())
+                        return 0;
+                }
+            }
+        }
+        if (Allocas.empty())
+            return 0;
+
+        uint64_t FrameSize = MinRedzone, FrameAlign = MinRedzone;
+        vector<uint64_t> Offsets;
+        for (AllocaInst* AI : Allocas) {
+            uint64_t Size, Alignment = max(MinRedzone, (uint64_t) AI->getAlign().value());
+            getObjectSize(AI, *Layout, Size);
+            FrameSize = alignTo(FrameSize, Alignment);
+            FrameAlign = max(FrameAlign, Alignment);
+            Offsets.push_back(FrameSize);
+            FrameSize += Size + getRedzoneSize(Size);
+        }
+
+        // one shadow byte per granule: left, middle and right redzones around
+        // the objects, partial granules hold the number of addressable bytes
+        uint64_t Granule = 1ULL << ShadowScale;
+        vector<uint8_t> Shadow(FrameSize / Granule, kStackMidRZ);
+        fill(Shadow.begin(), Shadow.begin() + MinRedzone / Granule, kStackLeftRZ);
+        uint64_t LastEnd = 0;
+        for (size_t i = 0; i < Allocas.size(); i++) {
+            uint64_t Size;
+            getObjectSize(Allocas[i], *Layout, Size);
+            fill(Shadow.begin() + Offsets[i] / Granule, Shadow.begin() + (Offsets[i] + Size) / Granule, 0);
+            if (Size % Granule)
+                Shadow[(Offsets[i] + Size) / Granule] = Size % Granule;
+            LastEnd = alignTo(Offsets[i] + Size, Granule) / Granule;
+        }
+        fill(Shadow.begin() + LastEnd, Shadow.end(), kStackRightRZ);
+
+        IRBuilder<> IRB(&F.getEntryBlock().front());
+        ArrayType* FrameTy = ArrayType::get(Int8Ty, FrameSize);
+        AllocaInst* Frame = IRB.CreateAlloca(FrameTy, nullptr, "learnsan.frame");
+        Frame->setAlignment(Align(FrameAlign));
+
+        // every use of an alloca comes after the leading allocas
+        IRB.SetInsertPoint(getFirstNonAlloca(F.getEntryBlock()));
+
+        for (size_t i = 0; i < Allocas.size(); i++) {
+            AllocaInst* AI = Allocas[i];
+            Value* Ptr = IRB.CreateConstInBoundsGEP2_64(FrameTy, Frame, 0, Offsets[i]);
+            Ptr = IRB.CreatePointerCast(Ptr, AI->getType());
+            eraseLifetimeMarkers(AI);
+            Ptr->takeName(AI);
+            AI->replaceAllUsesWith(Ptr);
+            AI->eraseFromParent();
+        }
+
+        Value* ShadowBase = IRB.CreateAdd(IRB.CreateLShr(IRB.CreatePtrToInt(Frame, Int64Ty), ShadowScale),
+                                          ConstantInt::get(Int64Ty, kShadowOffset));
+        size_t Stores = StoreShadow(IRB, ShadowBase, Shadow, Shadow);
+
+        // frames left by longjmp or an exception are cleared by
+        // __learnsan_handle_no_return, see InstrumentNoReturn
+        vector<uint8_t> Clean(Shadow.size(), 0);
+        for (ReturnInst* RI : Returns) {
+            IRB.SetInsertPoint(RI);
+            StoreShadow(IRB, ShadowBase, Shadow, Clean);
+        }
+
+        StackObjects += Allocas.size();
+        return Stores;
+    }
+
+    // The frames skipped by longjmp or by the unwinder never reach their
+    // returns, so the runtime clears the stack shadow below the caller before
+    // every call that doesn't return (longjmp, __cxa_throw) and every resume
+    size_t InstrumentNoReturn(Function& F) {
+        vector<Instruction*> Exits;
+        for (BasicBlock& BB : F) {
+            for (Instruction& I : BB) {
+                if (isa<ResumeInst>(I))
+                    Exits.push_back(&I);
+                else if (CallBase* CB = dyn_cast<CallBase>(&I)) {
+                    if (CB->doesNotReturn() && !isa<IntrinsicInst>(CB))
+                        Exits.push_back(CB);
+                }
+            }
+        }
+        for (Instruction* I : Exits)
+            IRBuilder<>(I).CreateCall(hook_no_return, {});
+        return Exits.size();
+    }
+
+    // Every instrumented module has a constructor, which first has the
+    // runtime check that both use the same shadow scale
+    void CreateModuleCtor(Module& M) {
+        FunctionCallee CheckScale = M.getOrInsertFunction("__learnsan_check_scale", VoidTy, Int64Ty);
+        ModuleCtor = Function::Create(FunctionType::get(VoidTy, false), GlobalValue::InternalLinkage,
+                                      "learnsan.module_ctor", M);
+        IRBuilder<> IRB(BasicBlock::Create(*C, "", ModuleCtor));
+        IRB.CreateCall(CheckScale, {ConstantInt::get(Int64Ty, ShadowScale)});
+        IRB.CreateRetVoid();
+        appendToGlobalCtors(M, ModuleCtor, 1);
+
+        // and the linker refuses to merge modules built with different scales
+        M.addModuleFlag(Module::Error, "learnsan.shadow_scale", ShadowScale);
+    }
+
+    // Pads every global we own with a trailing redzone; the runtime poisons
+    // them all once, from a module constructor
+    size_t InstrumentGlobals(Module& M) {
+        vector<GlobalVariable*> Globals;
+        for (GlobalVariable& GV : M.globals()) {
+            // the size of weak, common and comdat globals is decided at link
+            // time, and sections may be walked as arrays by the program
+            if (GV.isDeclaration() || !GV.hasDefinitiveInitializer() || GV.hasCommonLinkage() ||
+                GV.isThreadLocal() || GV.hasSection() || GV.hasComdat() ||
+                GV.getName().startswith("llvm.") || GV.getName().startswith("__learnsan"))
+                continue;
+            if (!GV.getValueType()->isSized() || Layout->getTypeAllocSize(GV.getValueType()).isScalable())
+                continue;
+            if (Layout->getTypeAllocSize(GV.getValueType()).getFixedSize() == 0)
+                continue;
+            Globals.push_back(&GV);
+        }
+        if (Globals.empty())
+            return 0;
+
+        StructType* DescTy = StructType::get(Int8PTy, Int64Ty, Int64Ty);
+        vector<Constant*> Descs;
+
+        for (GlobalVariable* GV : Globals) {
+            Type* Ty = GV->getValueType();
+            uint64_t Size = Layout->getTypeAllocSize(Ty).getFixedSize();
+            uint64_t RZ = getRedzoneSize(Size);
+
+            StructType* NewTy = StructType::get(Ty, ArrayType::get(Int8Ty, RZ));
+            Constant* NewInit = ConstantStruct::get(NewTy, {GV->getInitializer(),
+                                                   Constant::getNullValue(NewTy->getElementType(1))});
+            GlobalVariable* NewGV = new GlobalVariable(M, NewTy, GV->isConstant(), GV->getLinkage(),
+                                                       NewInit, "", GV, GV->getThreadLocalMode(),
+                                                       GV->getType()->getAddressSpace());
+            NewGV->copyAttributesFrom(GV);
+            uint64_t Alignment = GV->getAlign() ? GV->getAlign()->value() : 0;
+            NewGV->setAlignment(MaybeAlign(max(MinRedzone, Alignment)));
+
+            SmallVector<DIGlobalVariableExpression*, 1> DebugInfo;
+            GV->getDebugInfo(DebugInfo);
+            for (DIGlobalVariableExpression* DI : DebugInfo)
+                NewGV->addDebugInfo(DI);
+
+            NewGV->takeName(GV);
+            Constant* Indices[] = {ConstantInt::get(Int32Ty, 0), ConstantInt::get(Int32Ty, 0)};
+            GV->replaceAllUsesWith(ConstantExpr::getInBoundsGetElementPtr(NewTy, NewGV, Indices));
+            GV->eraseFromParent();
+
+            Descs.push_back(ConstantStruct::get(DescTy, {ConstantExpr::getPointerCast(NewGV, Int8PTy),
+                                                         ConstantInt::get(Int64Ty, Size),
+                                                         ConstantInt::get(Int64Ty, Size + RZ)}));
+        }
+
+        ArrayType* DescArrayTy = ArrayType::get(DescTy, Descs.size());
+        GlobalVariable* DescArray = new GlobalVariable(M, DescArrayTy, true, GlobalValue::PrivateLinkage,
+                                                       ConstantArray::get(DescArrayTy, Descs),
+                                                       "__learnsan_globals");
+
+        FunctionCallee RegisterGlobals = M.getOrInsertFunction("__learnsan_register_globals",
+                                                               VoidTy, Int8PTy, Int64Ty);
+        IRBuilder<> IRB(ModuleCtor->getEntryBlock().getTerminator());
+        IRB.CreateCall(RegisterGlobals, {IRB.CreatePointerCast(DescArray, Int8PTy),
+                                         ConstantInt::get(Int64Ty, Descs.size())});
+
+        return Globals.size();
+    }
+
+
+    // Links the hooks defined in the bitcode runtime into M, internalized, and
+    // inlines every call to them. The pass runs after the inliner, so the
+    // calls are inlined here rather than marked alwaysinline.
+    size_t InlineRuntime(Module& M) {
+        SMDiagnostic Err;
+        unique_ptr<Module> Runtime = parseIRFile(InlineRuntimePath, Err, *C);
+        if (!Runtime) {
+            Err.print("LearnSanitizer", errs());
+            return 0;
+        }
+        Runtime->setDataLayout(M.getDataLayout());
+        Runtime->setTargetTriple(M.getTargetTriple());
+
+        bool Failed = Linker::linkModules(M, std::move(Runtime), Linker::Flags::LinkOnlyNeeded,
+            [](Module& M, const StringSet<>& Linked) {
+                internalizeModule(M, [&Linked](const GlobalValue& GV) {
+                    return !GV.hasName() || Linked.count(GV.getName()) == 0;
+                });
+            });
+        if (Failed) {
+            errs() << "LearnSanitizer: failed to link " << InlineRuntimePath << "\n";
+            return 0;
+        }
+
+        // the definitions replaced the declarations, look the hooks up again
+        size_t Inlined = 0;
+        set<Function*> Helpers;
+        for (StringRef Name : {"__hook_load", "__hook_store"}) {
+            Function* F = M.getFunction(Name);
+            if (!F || F->isDeclaration())
+                continue;
+
+            vector<CallBase*> Calls;
+            for (User* U : F->users())
+                if (CallBase* CB = dyn_cast<CallBase>(U))
+                    if (CB->getCalledFunction() == F)
+                        Calls.push_back(CB);
+
+            // helpers of the hooks come along, the slow paths stay declarations
+            while (!Calls.empty()) {
+                CallBase* CB = Calls.back();
+                Calls.pop_back();
+                bool IsHook = CB->getCalledFunction() == F;
+                InlineFunctionInfo IFI;
+                if (!InlineFunction(*CB, IFI).isSuccess())
+                    continue;
+                Inlined += IsHook;
+                for (CallBase* Inner : IFI.InlinedCallSites) {
+                    Function* Callee = Inner->getCalledFunction();
+                    if (Callee && !Callee->isDeclaration() && Callee->hasLocalLinkage()) {
+                        Calls.push_back(Inner);
+                        Helpers.insert(Callee);
+                    }
+                }
+            }
+            Helpers.insert(F);
+        }
+
+        for (Function* F : Helpers)
+            if (F->use_empty())
+                F->eraseFromParent();
+
+        return Inlined;
+    }
+
+
     void InstrumentEntryOrExitPoints(vector<Instruction*> EntryExitPoints, Module& M, FunctionCallee HookRtn) {
         for (Instruction* I : EntryExitPoints) {
             Function* ParentFunc = I->getFunction();
             IRBuilder<> IRB(I);
             vector<Value*> args;            
 
-            Constant* fcn_name = ConstantDataArray::getString(*C, ParentFunc->getName(), true);
-            AllocaInst* Alloca = IRB.CreateAlloca(Int8PTy);
-            Value* FcnNameVal = static_cast<Value*>(Alloca);
-            IRB.CreateStore(fcn_name, FcnNameVal);
+            // the runtime keeps the pointer, one constant string per function
+            Value*& FcnNameVal = FunctionNames[ParentFunc];
+            if (!FcnNameVal)
+                FcnNameVal = IRB.CreateGlobalStringPtr(ParentFunc->getName(), "__learnsan_fn_name");
 
             args.push_back(FcnNameVal);
             CallInst* call = IRB.CreateCall(HookRtn, args); 
@@ -121,21 +705,45 @@ struct LearnSanitizerModulePass : public ModulePass {
 
   static char ID;
   //Hello() : ModulePass(ID) {}
-  explicit LearnSanitizerModulePass() : ModulePass(ID) {}
+  explicit LearnSanitizerModulePass()
+      : ModulePass(ID), Filter("LearnSanitizer", "LEARNSAN", "learnsan") {
+    ElideChecks = getenv("LEARNSAN_NO_ELIDE") == nullptr;
+    InstrumentStack = getenv("LEARNSAN_NO_STACK") == nullptr;
+    InstrumentGlobalVars = getenv("LEARNSAN_NO_GLOBALS") == nullptr;
+    InlineRuntimePath = getenv("LEARNSAN_INLINE_RT");
+
+    ShadowScale = kDefaultShadowScale;
+    if (const char* Scale = getenv("LEARNSAN_SHADOW_SCALE")) {
+        ShadowScale = strtoul(Scale, nullptr, 0);
+        if (ShadowScale < 3 || ShadowScale > 6)
+            report_fatal_error("LearnSanitizer: LEARNSAN_SHADOW_SCALE must be between 3 and 6");
+    }
+    // stack and global objects get redzones of at least 32 bytes, or a granule
+    MinRedzone = max((uint64_t) 32, (uint64_t) 1 << ShadowScale);
+  }
 
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
-    AU.addRequired<LoopInfoWrapperPass>();
+    if (ElideChecks)
+        AU.addRequired<AndersonAnalysisModulePass>();
   }
 
   bool doInitialization(Module &M) override {
     DEBUG(errs() << "INITIALIZATION \n");
+    SamplingMode = getenv("LEARNSAN_SAMPLING") != nullptr;
 	return true;
   }
   
   bool runOnModule(Module &M) override {
+    InstructionIndex Index(M);
+    return instrumentModule(M, Index, [this]() -> AndersonAnalysisModulePass& {
+        return getAnalysis<AndersonAnalysisModulePass>();
+    });
+  }
 
-    //_M(M);
+  // GetAnderson is only called when the checks are elided
+  bool instrumentModule(Module &M, const InstructionIndex &Index,
+                        function_ref<AndersonAnalysisModulePass&()> GetAnderson) {
 
     C = &(M.getContext());
     Layout = new DataLayout(&M);
@@ -157,71 +765,149 @@ struct LearnSanitizerModulePass : public ModulePass {
  
     hook_store = M.getOrInsertFunction("__hook_store", VoidTy, Int64Ty, Int64Ty);
     hook_load = M.getOrInsertFunction("__hook_load", VoidTy, Int64Ty, Int64Ty);
-    hook_malloc = M.getOrInsertFunction("__hook_malloc", Int8PTy, Int64Ty);
-    hook_free = M.getOrInsertFunction("__hook_free", VoidTy, Int64Ty);
+    hook_store_range = M.getOrInsertFunction("__hook_store_range", VoidTy, Int64Ty, Int64Ty);
+    hook_load_range = M.getOrInsertFunction("__hook_load_range", VoidTy, Int64Ty, Int64Ty);
     hook_entry = M.getOrInsertFunction("__hook_entry", VoidTy, Int8PTy);
     hook_exit = M.getOrInsertFunction("__hook_exit", VoidTy, Int8PTy);
+    hook_no_return = M.getOrInsertFunction("__learnsan_handle_no_return", VoidTy);
+
+    if (SamplingMode) {
+        // the counter lives in the runtime, which is always part of the executable
+        SampleCounter = new GlobalVariable(M, Int32Ty, false, GlobalValue::ExternalLinkage, nullptr,
+                                           "__learnsan_sample_counter", nullptr,
+                                           GlobalVariable::InitialExecTLSModel);
+    }
     
 
     vector<Instruction*> Stores, Loads;
-    vector<CallInst*> Mallocs, Frees;
+    vector<CallBase*> HeapCalls, Intercepted;
+    vector<MemIntrinsic*> MemIntrinsics;
     vector<Instruction*> EntryPoints;
     vector<Instruction*> ReturnInstructions;
+    vector<Function*> Functions;
     
 
+    unsigned NoSanitize = M.getMDKindID("nosanitize");
+    Filter.select(M, isBlacklisted);
+
     for (Function& F : M) {
-        if (isBlacklisted(F))
+        if (isBlacklisted(F) || F.isDeclaration())
             continue;
-        for (BasicBlock& BB : F) {
-
-            if (&F.getEntryBlock() == &BB)
-                EntryPoints.push_back(&(BB.front()));
+        const FunctionInstructions& FI = Index.get(F);
 
-            for (Instruction& I : BB) {
+        if (!Filter.isSelected(F)) {
+            for (CallBase* Call : FI.Calls) {
+                if (Call->getCalledFunction() && !Call->getMetadata(NoSanitize) &&
+                    getHeapHook(Call->getCalledFunction()->getName()))
+                    HeapCalls.push_back(Call);
+            }
+            continue;
+        }
+        Functions.push_back(&F);
 
-                if (StoreInst* ST = dyn_cast<StoreInst>(&I)) {
-                    Stores.push_back(ST);
-                }
-                else if (LoadInst* LO = dyn_cast<LoadInst>(&I)) {
-                    Loads.push_back(LO);
-                }
-                else if (CallInst* Call = dyn_cast<CallInst>(&I)) {
+        for (StoreInst* ST : FI.Stores) {
+            if (!ST->getMetadata(NoSanitize))
+                Stores.push_back(ST);
+        }
+        for (LoadInst* LO : FI.Loads) {
+            if (!LO->getMetadata(NoSanitize))
+                Loads.push_back(LO);
+        }
+        for (MemIntrinsic* MI : FI.MemIntrinsics) {
+            if (!MI->getMetadata(NoSanitize))
+                MemIntrinsics.push_back(MI);
+        }
+        for (CallBase* Call : FI.Calls) {
 
-                    if (!Call->getCalledFunction()->getName().compare("malloc")) {
-                        Mallocs.push_back(Call);
-                    }
-                    else if (!Call->getCalledFunction()->getName().compare("free")) {
-                        Frees.push_back(Call);
-                    }
-                    else 
-                        // other heap functions (realloc, ..)
-                        continue;
+            if (!Call->getCalledFunction() || Call->getMetadata(NoSanitize))
+                continue;
 
-                }
-                else if (ReturnInst* RI = dyn_cast<ReturnInst>(&I)) {
-                    ReturnInstructions.push_back(RI);
-                }
+            if (getHeapHook(Call->getCalledFunction()->getName())) {
+                HeapCalls.push_back(Call);
             }
+            else if (isIntercepted(Call->getCalledFunction()->getName())) {
+                Intercepted.push_back(Call);
+            }
+        }
+        for (Instruction* I : FI.Exits) {
+            if (isa<ReturnInst>(I) && !I->getMetadata(NoSanitize))
+                ReturnInstructions.push_back(I);
         }
     }
 
-    InstrumentEntryOrExitPoints(EntryPoints, M, hook_entry);
+    size_t Checks = Stores.size() + Loads.size(), Elided = 0;
+    if (ElideChecks) {
+        AndersonAnalysisModulePass& Anderson = GetAnderson();
+        Elided += ElideSafeAccesses(Stores, Anderson);
+        Elided += ElideSafeAccesses(Loads, Anderson);
+    }
+
+    // the frames are rewritten after the elision, which needs the original
+    // allocas to know the object sizes
+    CreateModuleCtor(M);
+
+    size_t ShadowStores = 0, Globals = 0, NoReturns = 0;
+    StackObjects = 0;
+    if (InstrumentStack && !SamplingMode) {
+        for (Function* F : Functions) {
+            ShadowStores += InstrumentStackFrame(*F);
+            NoReturns += InstrumentNoReturn(*F);
+        }
+    }
+    if (InstrumentGlobalVars)
+        Globals = InstrumentGlobals(M);
+
+    for (Function* F : Functions)
+        EntryPoints.push_back(getFirstNonAlloca(F->getEntryBlock()));
+
+    if (getenv("LEARNSAN_STATS")) {
+        errs() << "LearnSanitizer: " << M.getName() << ": " << Elided << " of " << Checks
+               << " memory checks elided as provably safe\n";
+        errs() << "LearnSanitizer: " << M.getName() << ": " << StackObjects << " stack objects, "
+               << ShadowStores << " shadow stores in prologues, " << NoReturns << " noreturn calls, "
+               << Globals << " globals padded\n";
+    }
 
-    ReplaceHeapFunctions(Mallocs, hook_malloc);
-    ReplaceHeapFunctions(Frees, hook_free);
+    // the shadow callstack costs a call per function, too much for sampling mode
+    if (!SamplingMode)
+        InstrumentEntryOrExitPoints(EntryPoints, M, hook_entry);
 
-    InstrumentMemoryAccesses(Stores, M, hook_store);
-    InstrumentMemoryAccesses(Loads, M, hook_load);
+    ReplaceHeapFunctions(HeapCalls, M);
 
-    InstrumentEntryOrExitPoints(ReturnInstructions, M, hook_exit);
+    ReplaceInterceptedFunctions(Intercepted, M);
+
+    InstrumentMemoryAccesses(Stores, M, hook_store, hook_store_range);
+    InstrumentMemoryAccesses(Loads, M, hook_load, hook_load_range);
+    InstrumentMemIntrinsics(MemIntrinsics, M);
+
+    if (!SamplingMode)
+        InstrumentEntryOrExitPoints(ReturnInstructions, M, hook_exit);
+
+    if (InlineRuntimePath) {
+        size_t Inlined = InlineRuntime(M);
+        if (getenv("LEARNSAN_STATS"))
+            errs() << "LearnSanitizer: " << M.getName() << ": " << Inlined << " checks inlined\n";
+    }
     
  
-    return false;
+    return true;
   }
 }; 
 
 char LearnSanitizerModulePass::ID = 0;
 
+#ifdef SECURITY_PLUGIN
+PreservedAnalyses LearnSanitizerPass::run(Module &M, ModuleAnalysisManager &MAM) {
+
+  LearnSanitizerModulePass Pass;
+  Pass.doInitialization(M);
+  Pass.instrumentModule(M, MAM.getResult<InstructionIndexAnalysis>(M), [&]() -> AndersonAnalysisModulePass& {
+    return *MAM.getResult<AndersonAnalysis>(M);
+  });
+  return PreservedAnalyses::none();
+
+}
+#else
 static void registerLearnSanitizerPass(const PassManagerBuilder &,
                                legacy::PassManagerBase &PM) {
 
@@ -240,3 +926,4 @@ static RegisterPass<LearnSanitizerModulePass>
       false,
       false
     );
+#endif
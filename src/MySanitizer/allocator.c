@@ -1,79 +1,438 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <malloc.h>
+#include <pthread.h>
 
 #include "allocator.h"
 
 
+/*
+ * Freed chunks are kept in a per-thread FIFO quarantine, still poisoned as
+ * ASAN_HEAP_FREED, so that a use-after-free hits the shadow instead of a
+ * recycled chunk. The list is linked through the next/prev fields of the
+ * chunk header and is only touched by its own thread, so free() takes no lock.
+ * When the byte budget is exceeded the oldest chunks are handed back to libc
+ * in one batch, which keeps the cost of free() amortized O(1).
+ */
+struct quarantine {
+    struct chunk_begin* head;
+    struct chunk_begin* tail;
+    size_t size;
+    size_t unpublished;
+    int registered;
+};
+
+static __thread struct quarantine thread_quarantine;
+
+static size_t quarantine_budget = DEFAULT_QUARANTINE_SIZE;
+static pthread_key_t quarantine_key;
+static int quarantine_key_ready;
+static int print_stats;
+
+/* global counters, updated once per eviction batch */
+static size_t stat_quarantined_bytes;
+static size_t stat_evicted_bytes;
+static size_t stat_evicted_chunks;
+static size_t stat_evict_batches;
+
+
+/* bytes of shadow a chunk poisoned, from the start of its libc block */
+static size_t chunk_footprint(struct chunk_begin* p) {
+    size_t slack = p->aligned_orig ? (char*) p - (char*) p->aligned_orig : 0;
+    return slack + sizeof(struct chunk_begin) +
+           ALIGN_UP(p->requested_size & ~CHUNK_FREED, ALLOC_ALIGN_SIZE) + REDZONE_SIZE;
+}
+
+static void quarantine_publish(struct quarantine* q) {
+    __atomic_fetch_add(&stat_quarantined_bytes, q->unpublished, __ATOMIC_RELAXED);
+    q->unpublished = 0;
+}
+
+static void quarantine_evict(struct quarantine* q, size_t target) {
+    size_t bytes = 0, chunks = 0;
+
+    while (q->head && q->size > target) {
+        struct chunk_begin* p = q->head;
+        size_t n = chunk_footprint(p);
+
+        q->head = p->next;
+        q->size -= n;
+        bytes += n;
+        chunks++;
+
+        // libc may hand this memory to uninstrumented code, don't leave it poisoned
+        learnsan_unpoison(p->aligned_orig ? p->aligned_orig : (void*) p, n);
+        if (p->aligned_orig)
+            free(p->aligned_orig);
+        else
+            free(p);
+    }
+
+    if (q->head)
+        q->head->prev = NULL;
+    else
+        q->tail = NULL;
+
+    quarantine_publish(q);
+    __atomic_fetch_add(&stat_evicted_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat_evicted_chunks, chunks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat_evict_batches, 1, __ATOMIC_RELAXED);
+}
+
+static void quarantine_drain(void* arg) {
+    // thread exit: nobody else will ever evict this thread's chunks
+    quarantine_evict((struct quarantine*) arg, 0);
+}
+
+static void quarantine_push(struct chunk_begin* p) {
+    struct quarantine* q = &thread_quarantine;
+    size_t n = chunk_footprint(p);
+
+    if (!q->registered && quarantine_key_ready) {
+        pthread_setspecific(quarantine_key, q);
+        q->registered = 1;
+    }
+
+    p->next = NULL;
+    p->prev = q->tail;
+    if (q->tail)
+        q->tail->next = p;
+    else
+        q->head = p;
+    q->tail = p;
+    q->size += n;
+    q->unpublished += n;
+
+    if (q->size > quarantine_budget)
+        quarantine_evict(q, quarantine_budget - quarantine_budget / QUARANTINE_EVICT_FRACTION);
+}
+
+
+static char* guarded_pool;
+static int heap_sampling = -1;
+static unsigned malloc_sample_rate;
+static size_t next_guarded_slot;
+static uint8_t guarded_slot_used[GUARDED_SLOTS];
+static size_t guarded_slot_size[GUARDED_SLOTS];
+static pthread_once_t heap_sampling_once = PTHREAD_ONCE_INIT;
+
+static size_t stat_sampled_allocations;
+
+static __thread int malloc_sample_counter;
+static __thread uint32_t sample_seed;
+
+
+/* random period with mean rate, so sampling does not lock onto a loop pattern */
+unsigned __learnsan_next_sample_period(unsigned rate) {
+    uint32_t x = sample_seed;
+    if (!x)
+        x = (uint32_t)(uintptr_t) &sample_seed ^ (uint32_t) getpid() ^ 0x9e3779b9;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sample_seed = x;
+    if (rate <= 1)
+        return 1;
+    return 1 + x % (2 * rate - 1);
+}
+
+/* decided once, at the first allocation, so chunks of the two kinds are never mixed */
+static void heap_sampling_init() {
+    char* env = getenv("LEARNSAN_MALLOC_SAMPLE_RATE");
+    unsigned rate = env ? strtoul(env, NULL, 0) : 0;
+
+    if (rate) {
+        void* pool = mmap(NULL, (size_t) GUARDED_SLOTS * GUARDED_SLOT_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_NORESERVE | MAP_ANON, -1, 0);
+        if (pool == MAP_FAILED) {
+            perror("Failed to mmap the guarded pool, heap sampling is disabled\n");
+        } else {
+            guarded_pool = pool;
+            malloc_sample_rate = rate;
+        }
+    }
+
+    __atomic_store_n(&heap_sampling, guarded_pool != NULL, __ATOMIC_RELEASE);
+}
+
+static int heap_sampling_enabled() {
+    int enabled = __atomic_load_n(&heap_sampling, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(enabled < 0, 0)) {
+        pthread_once(&heap_sampling_once, heap_sampling_init);
+        enabled = heap_sampling;
+    }
+    return enabled;
+}
+
+static int is_guarded(void* ptr) {
+    return (char*) ptr >= guarded_pool &&
+           (char*) ptr < guarded_pool + (size_t) GUARDED_SLOTS * GUARDED_SLOT_SIZE;
+}
+
+static void* guarded_malloc(size_t size) {
+    if (size > GUARDED_SLOT_SIZE - 2 * REDZONE_SIZE)
+        return NULL;
+
+    if (--malloc_sample_counter > 0)
+        return NULL;
+    malloc_sample_counter = __learnsan_next_sample_period(malloc_sample_rate);
+
+    size_t idx = __atomic_fetch_add(&next_guarded_slot, 1, __ATOMIC_RELAXED) % GUARDED_SLOTS;
+    uint8_t expected = 0;
+    if (!__atomic_compare_exchange_n(&guarded_slot_used[idx], &expected, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return NULL;
+
+    char* slot = guarded_pool + idx * GUARDED_SLOT_SIZE;
+    char* user = slot + REDZONE_SIZE;
+    guarded_slot_size[idx] = size;
+
+    learnsan_poison(slot, REDZONE_SIZE, ASAN_HEAP_LEFT_RZ);
+    learnsan_unpoison(user, size);
+    learnsan_poison(user + size, slot + GUARDED_SLOT_SIZE - (user + size), ASAN_HEAP_RIGHT_RZ);
+    memset(user, 0xff, size);
+
+    __atomic_fetch_add(&stat_sampled_allocations, 1, __ATOMIC_RELAXED);
+    return user;
+}
+
+static int guarded_free(void* ptr) {
+    size_t idx = ((char*) ptr - guarded_pool) / GUARDED_SLOT_SIZE;
+    uint8_t expected = 1;
+
+    // not the start of a sampled chunk, or already freed. The slot stays
+    // busy (2) while it is poisoned, so malloc can't reuse it under us
+    if ((char*) ptr != guarded_pool + idx * GUARDED_SLOT_SIZE + REDZONE_SIZE ||
+        !__atomic_compare_exchange_n(&guarded_slot_used[idx], &expected, 2, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 1;
+
+    size_t n = guarded_slot_size[idx];
+    if (n & (ALLOC_ALIGN_SIZE - 1))
+        n = (n & ~(ALLOC_ALIGN_SIZE - 1)) + ALLOC_ALIGN_SIZE;
+
+    learnsan_poison(ptr, n, ASAN_HEAP_FREED);
+    __atomic_store_n(&guarded_slot_used[idx], 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
 void __init_all() {
     learnsan_init();
+
+    char* env = getenv("LEARNSAN_QUARANTINE_SIZE");
+    if (env)
+        quarantine_budget = strtoull(env, NULL, 0);
+    print_stats = getenv("LEARNSAN_STATS") != NULL;
+
+    if (!pthread_key_create(&quarantine_key, quarantine_drain))
+        quarantine_key_ready = 1;
 }
 
-void* __learnsan_malloc(size_t size) {
-    struct chunk_begin* p = malloc(sizeof(struct chunk_struct) + size);
-    if (!p) 
-        return NULL;
+void __fini_all() {
+    if (!print_stats)
+        return;
+
+    quarantine_publish(&thread_quarantine);
+
+    size_t quarantined = __atomic_load_n(&stat_quarantined_bytes, __ATOMIC_RELAXED);
+    size_t evicted = __atomic_load_n(&stat_evicted_bytes, __ATOMIC_RELAXED);
+
+    fprintf(stderr, "learnsanitizer quarantine: budget %zu bytes per thread, %zu bytes held\n",
+            quarantine_budget, quarantined - evicted);
+    fprintf(stderr, "learnsanitizer quarantine: %zu bytes in %zu chunks evicted in %zu batches\n",
+            evicted, __atomic_load_n(&stat_evicted_chunks, __ATOMIC_RELAXED),
+            __atomic_load_n(&stat_evict_batches, __ATOMIC_RELAXED));
+    if (malloc_sample_rate)
+        fprintf(stderr, "learnsanitizer heap sampling: 1 every %u, %zu allocations guarded\n",
+                malloc_sample_rate, __atomic_load_n(&stat_sampled_allocations, __ATOMIC_RELAXED));
+}
 
-    learnsan_unpoison(p, sizeof(struct chunk_struct) + size);
+static void* chunk_alloc(size_t size) {
+    void* p;
+    if (ALLOC_ALIGN_SIZE > _Alignof(max_align_t))
+        return posix_memalign(&p, ALLOC_ALIGN_SIZE, size) ? NULL : p;
+    return malloc(size);
+}
+
+/* from the end of the user bytes to the end of the right redzone */
+static void poison_right_redzone(char* user, size_t size) {
+    learnsan_poison(user + size, ALIGN_UP(size, ALLOC_ALIGN_SIZE) - size + REDZONE_SIZE,
+                    ASAN_HEAP_RIGHT_RZ);
+}
+
+/* orig is the block returned by libc, p the header right before the user bytes */
+static void* chunk_init(void* orig, struct chunk_begin* p, size_t size) {
+    char* user = (char*) &p[1];
+
+    learnsan_unpoison(p, sizeof(struct chunk_begin) + size);
+    if ((void*) p != orig)
+        learnsan_poison(orig, (char*) p - (char*) orig, ASAN_HEAP_LEFT_RZ);
     
     p->requested_size = size;
-    p->aligned_orig = NULL; 
+    p->aligned_orig = (void*) p != orig ? orig : NULL; 
     p->next = p->prev = NULL;
 
+    learnsan_poison(p->redzone, CHUNK_REDZONE_SIZE, ASAN_HEAP_LEFT_RZ);
+    poison_right_redzone(user, size);
+    
+    memset(user, 0xff, size);
 
+    return user;
+}
 
-    learnsan_poison(p->redzone, REDZONE_SIZE, ASAN_HEAP_LEFT_RZ);
-    if (size & (ALLOC_ALIGN_SIZE - 1))
-        learnsan_poison((char*)&p[1] + size, (size & ~(ALLOC_ALIGN_SIZE - 1) + 8 - size + REDZONE_SIZE),
-                        ASAN_HEAP_RIGHT_RZ);
-    else
-        learnsan_poison((char*)&p[1] + size, REDZONE_SIZE, ASAN_HEAP_RIGHT_RZ);
-    
-    memset(&p[1], 0xff, size);
+void* __learnsan_malloc(size_t size) {
+    if (heap_sampling_enabled()) {
+        void* guarded = guarded_malloc(size);
+        return guarded ? guarded : malloc(size);
+    }
 
-    return &p[1];
-    
+    struct chunk_begin* p = chunk_alloc(sizeof(struct chunk_struct) + size);
+    if (!p) 
+        return NULL;
+
+    return chunk_init(p, p, size);
+}
+
+void* __learnsan_calloc(size_t n, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(n, size, &total))
+        return NULL;
+
+    void* p = __learnsan_malloc(total);
+    if (p)
+        memset(p, 0, total);
+    return p;
+}
+
+/*
+ * Alignments above ALLOC_ALIGN_SIZE over-allocate and place the header right
+ * before the first aligned address, the slack in front is left redzone.
+ */
+void* __learnsan_memalign(size_t alignment, size_t size) {
+    if (alignment <= ALLOC_ALIGN_SIZE)
+        return __learnsan_malloc(size);
+
+    if (heap_sampling_enabled()) {
+        void* p;
+        return posix_memalign(&p, alignment, size) ? NULL : p;
+    }
+
+    char* orig = chunk_alloc(sizeof(struct chunk_struct) + size + alignment);
+    if (!orig)
+        return NULL;
+
+    char* user = (char*) ALIGN_UP((uintptr_t) orig + sizeof(struct chunk_begin), alignment);
+    return chunk_init(orig, (struct chunk_begin*) user - 1, size);
 }
 
+/*
+ * The new size is served in place when it still fits, with its redzone, in
+ * the block libc gave us: malloc rounds blocks up, so small growths and all
+ * shrinks only move the right redzone. Returns non zero if ptr was freed.
+ */
+int __learnsan_realloc(void* ptr, size_t size, void** result) {
+    if (!ptr) {
+        *result = __learnsan_malloc(size);
+        return 0;
+    }
+    if (size == 0) {
+        *result = NULL;
+        return __learnsan_free(ptr);
+    }
+
+    size_t old;
+    if (heap_sampling_enabled()) {
+        if (!is_guarded(ptr)) {
+            *result = realloc(ptr, size);
+            return 0;
+        }
+        old = guarded_slot_size[((char*) ptr - guarded_pool) / GUARDED_SLOT_SIZE];
+    }
+    else {
+        struct chunk_begin* p = (struct chunk_begin*) ptr - 1;
+        old = __atomic_load_n(&p->requested_size, __ATOMIC_RELAXED);
+        if (old & CHUNK_FREED)
+            return 1;
 
+        if (!p->aligned_orig &&
+            sizeof(struct chunk_begin) + ALIGN_UP(size, ALLOC_ALIGN_SIZE) + REDZONE_SIZE <=
+            malloc_usable_size(p)) {
+            learnsan_unpoison(ptr, ALIGN_UP(old, ALLOC_ALIGN_SIZE) + REDZONE_SIZE);
+            poison_right_redzone(ptr, size);
+            if (size > old)
+                memset((char*) ptr + old, 0xff, size - old);
+            p->requested_size = size;
+            *result = ptr;
+            return 0;
+        }
+    }
 
-void __learnsan_free(void* ptr) {
+    void* moved = __learnsan_malloc(size);
+    *result = moved;
+    if (!moved)
+        return 0;
+    memcpy(moved, ptr, old < size ? old : size);
+    return __learnsan_free(ptr);
+}
+
+
+
+int __learnsan_free(void* ptr) {
     if (!ptr)
-        return;
+        return 0;
+
+    if (heap_sampling_enabled()) {
+        if (is_guarded(ptr))
+            return guarded_free(ptr);
+        free(ptr);
+        return 0;
+    }
     
     struct chunk_begin* p = ptr;
     p -= 1;
 
-    size_t n = p->requested_size;
-    if (p->aligned_orig)
-        free(p->aligned_orig);
-    else
-        free(p);
+    size_t n = __atomic_load_n(&p->requested_size, __ATOMIC_RELAXED);
+    if ((n & CHUNK_FREED) ||
+        !__atomic_compare_exchange_n(&p->requested_size, &n, n | CHUNK_FREED, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return 1;
 
     if (n & (ALLOC_ALIGN_SIZE - 1))
-        n = (n & !(ALLOC_ALIGN_SIZE - 1)) + ALLOC_ALIGN_SIZE;
+        n = (n & ~(ALLOC_ALIGN_SIZE - 1)) + ALLOC_ALIGN_SIZE;
 
     learnsan_poison(ptr, n, ASAN_HEAP_FREED);
+    quarantine_push(p);
+    return 0;
 }
 
 int __learnsan_load(void* ptr, unsigned int size) {
     if (size == 1)
         return learnsan_load1(ptr);
+    else if (size == 2)
+        return learnsan_load2(ptr);
     else if (size == 4)
         return learnsan_load4(ptr);
     else if (size == 8)
         return learnsan_load8(ptr);
     else
-        return 0;
+        return learnsan_check_range(ptr, size);
 }
 
 int __learnsan_store(void* ptr, unsigned int size){
     if (size == 1)
         return learnsan_store1(ptr);
+    else if (size == 2)
+        return learnsan_store2(ptr);
     else if (size == 4)
         return learnsan_store4(ptr);
     else if (size == 8)
         return learnsan_store8(ptr);
     else
-        return 0;
+        return learnsan_check_range(ptr, size);
+}
+
+int __learnsan_check_range(void* ptr, size_t size) {
+    return learnsan_check_range(ptr, size);
 }
@@ -2,25 +2,61 @@
 
 
 #define REDZONE_SIZE 128
-#define ALLOC_ALIGN_SIZE (_Alignof(max_align_t))
+/* chunks start on a granule, so that their shadow describes them exactly */
+#define ALLOC_ALIGN_SIZE (SHADOW_GRANULE > _Alignof(max_align_t) ? SHADOW_GRANULE : _Alignof(max_align_t))
+#define ALIGN_UP(n, a) (((n) + (a) - 1) & ~((a) - 1))
+
+/* per-thread quarantine budget in bytes, LEARNSAN_QUARANTINE_SIZE overrides it */
+#define DEFAULT_QUARANTINE_SIZE (1 << 24)
+/* once the budget is exceeded we evict down to budget - budget / QUARANTINE_EVICT_FRACTION */
+#define QUARANTINE_EVICT_FRACTION 4
+
+/*
+ * With LEARNSAN_MALLOC_SAMPLE_RATE=N only about one allocation every N gets
+ * redzones: it is placed in a slot of the guarded pool, everything else comes
+ * straight from libc. Slots are recycled round robin, so a freed slot sits in
+ * quarantine until the other GUARDED_SLOTS - 1 slots have been handed out.
+ */
+#define GUARDED_SLOTS 1024
+#define GUARDED_SLOT_SIZE (1 << 14)
+
+/*
+ * free() sets CHUNK_FREED in requested_size with a CAS, so a chunk can enter
+ * a quarantine only once even when two threads free it concurrently
+ */
+#define CHUNK_FREED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+/* the left redzone of a chunk grows so that the header is a multiple of the alignment */
+#define CHUNK_FIELDS_SIZE (2 * sizeof(size_t) + 2 * sizeof(void*))
+#define CHUNK_REDZONE_SIZE (ALIGN_UP(CHUNK_FIELDS_SIZE + REDZONE_SIZE, ALLOC_ALIGN_SIZE) - CHUNK_FIELDS_SIZE)
 
 struct chunk_begin {
     size_t requested_size;
     void* aligned_orig;
     struct chunk_begin* next;
     struct chunk_begin* prev;
-    char redzone[REDZONE_SIZE];
+    char redzone[CHUNK_REDZONE_SIZE];
 };
 
 struct chunk_struct {
     struct chunk_begin begin;
     char redzone[REDZONE_SIZE];
-    size_t prev_size_padding;
+    // the right redzone starts on the first granule after the user bytes
+    char align_padding[ALLOC_ALIGN_SIZE];
 };
 
 void __init_all();
+void __fini_all();
 
 void* __learnsan_malloc(size_t size);
-void __learnsan_free(void* ptr);
+void* __learnsan_calloc(size_t n, size_t size);
+void* __learnsan_memalign(size_t alignment, size_t size);
+/* returns non zero if ptr was already freed, *result gets the new chunk */
+int __learnsan_realloc(void* ptr, size_t size, void** result);
+/* returns non zero on a double free */
+int __learnsan_free(void* ptr);
 int __learnsan_load(void* ptr, unsigned int size);
 int __learnsan_store(void* ptr, unsigned int size);
+int __learnsan_check_range(void* ptr, size_t size);
+
+unsigned __learnsan_next_sample_period(unsigned rate);
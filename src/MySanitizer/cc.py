@@ -17,6 +17,10 @@ assert(os.path.isfile(runtime_path) and "runtime file doesn't exist")
 
 is_cxx = "++" in sys.argv[0]
 
+# LEARNSAN_INLINE_RT=1 inlines the checks from the bitcode runtime built here
+if os.getenv("LEARNSAN_INLINE_RT") == "1":
+    os.environ["LEARNSAN_INLINE_RT"] = os.path.join(script_dir, "./learnsan-rt.bc")
+
 def cc_exec(args):
     if os.getenv("CUSTOM_CC"):
         cc_name = os.environ["CUSTOM_CC"]
@@ -61,7 +65,8 @@ def ld_mode():
       "-Xclang", "-load", "-Xclang", os.path.join(script_dir, "./LearnSanitizer.so"),
     ]
 
-    #args += ["-ldl"]
+    # the quarantine registers a per-thread destructor, reports use dladdr
+    args += ["-lpthread", "-ldl"]
     
     return cc_exec(args)
 
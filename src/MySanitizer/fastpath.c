@@ -0,0 +1,34 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "learnsan.h"
+
+/*
+ * Hot path of the sized checks, compiled to learnsan-rt.bc. When
+ * LEARNSAN_INLINE_RT points to it, the pass links these definitions into the
+ * instrumented module and inlines them at every check, so only a failing
+ * check makes a call. The out of line __hook_load/__hook_store of runtime.c
+ * keep serving the modules built without it.
+ *
+ * The pass only calls these with a size of 1, 2, 4 or 8 bytes, which becomes
+ * a constant once inlined.
+ */
+
+extern void __learnsan_report(int kind, long addr, size_t size);
+
+static inline int access_is_bad(long addr, unsigned long size) {
+    int8_t content = *(int8_t*) MEM_TO_SHADOW((uintptr_t) addr);
+    if (size == SHADOW_GRANULE)
+        return content != 0;
+    return content != 0 && (int)((addr & (SHADOW_GRANULE - 1)) + size) > content;
+}
+
+void __hook_load(long addr, unsigned long size) {
+    if (__builtin_expect(access_is_bad(addr, size), 0))
+        __learnsan_report(LEARNSAN_ACCESS_LOAD, addr, size);
+}
+
+void __hook_store(long addr, unsigned long size) {
+    if (__builtin_expect(access_is_bad(addr, size), 0))
+        __learnsan_report(LEARNSAN_ACCESS_STORE, addr, size);
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "learnsan.h"
+
+/*
+ * Replacements for the libc memory and string functions. The pass redirects
+ * calls to foo() to __hook_foo(), each hook checks the whole range that the
+ * real function is going to touch with a single range check and then
+ * forwards to libc.
+ */
+
+extern void __learnsan_check_access(void* pc, int kind, long addr, size_t size);
+
+// errors are attributed to the caller of the intercepted function
+#define CHECK_READ(ptr, size) \
+    __learnsan_check_access(__builtin_return_address(0), LEARNSAN_ACCESS_LOAD, (long)(ptr), (size))
+#define CHECK_WRITE(ptr, size) \
+    __learnsan_check_access(__builtin_return_address(0), LEARNSAN_ACCESS_STORE, (long)(ptr), (size))
+
+
+extern void* __hook_memcpy(void* dst, const void* src, size_t n) {
+    CHECK_READ(src, n);
+    CHECK_WRITE(dst, n);
+    return memcpy(dst, src, n);
+}
+
+extern void* __hook_memmove(void* dst, const void* src, size_t n) {
+    CHECK_READ(src, n);
+    CHECK_WRITE(dst, n);
+    return memmove(dst, src, n);
+}
+
+extern void* __hook_memset(void* dst, int c, size_t n) {
+    CHECK_WRITE(dst, n);
+    return memset(dst, c, n);
+}
+
+extern int __hook_memcmp(const void* s1, const void* s2, size_t n) {
+    CHECK_READ(s1, n);
+    CHECK_READ(s2, n);
+    return memcmp(s1, s2, n);
+}
+
+extern size_t __hook_strlen(const char* s) {
+    size_t n = strlen(s);
+    CHECK_READ(s, n + 1);
+    return n;
+}
+
+extern size_t __hook_strnlen(const char* s, size_t maxlen) {
+    size_t n = strnlen(s, maxlen);
+    CHECK_READ(s, n < maxlen ? n + 1 : n);
+    return n;
+}
+
+extern char* __hook_strcpy(char* dst, const char* src) {
+    size_t n = strlen(src) + 1;
+    CHECK_READ(src, n);
+    CHECK_WRITE(dst, n);
+    return memcpy(dst, src, n);
+}
+
+extern char* __hook_strncpy(char* dst, const char* src, size_t n) {
+    size_t len = strnlen(src, n);
+    CHECK_READ(src, len < n ? len + 1 : n);
+    CHECK_WRITE(dst, n);
+    return strncpy(dst, src, n);
+}
+
+extern char* __hook_strcat(char* dst, const char* src) {
+    size_t dst_len = strlen(dst);
+    size_t src_len = strlen(src) + 1;
+    CHECK_READ(dst, dst_len + 1);
+    CHECK_READ(src, src_len);
+    CHECK_WRITE(dst + dst_len, src_len);
+    memcpy(dst + dst_len, src, src_len);
+    return dst;
+}
+
+extern char* __hook_strncat(char* dst, const char* src, size_t n) {
+    size_t dst_len = strlen(dst);
+    size_t src_len = strnlen(src, n);
+    CHECK_READ(dst, dst_len + 1);
+    CHECK_READ(src, src_len < n ? src_len + 1 : src_len);
+    CHECK_WRITE(dst + dst_len, src_len + 1);
+    return strncat(dst, src, n);
+}
+
+extern int __hook_strcmp(const char* s1, const char* s2) {
+    size_t i = 0;
+    while (s1[i] && s1[i] == s2[i])
+        i++;
+    CHECK_READ(s1, i + 1);
+    CHECK_READ(s2, i + 1);
+    return (unsigned char) s1[i] - (unsigned char) s2[i];
+}
+
+extern int __hook_strncmp(const char* s1, const char* s2, size_t n) {
+    size_t i = 0;
+    if (n == 0)
+        return 0;
+    while (i < n - 1 && s1[i] && s1[i] == s2[i])
+        i++;
+    CHECK_READ(s1, i + 1);
+    CHECK_READ(s2, i + 1);
+    return (unsigned char) s1[i] - (unsigned char) s2[i];
+}
@@ -4,53 +4,46 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <string.h>
 
-#define HIGH_SHADOW_ADDR ((void*)0x02008fff7000ULL)
-#define LOW_SHADOW_ADDR ((void*)0x00007fff8000ULL)
-#define GAP_SHADOW_ADDR ((void*)0x00008fff7000)
-
-#define HIGH_SHADOW_SIZE (0xdfff0000fffULL)
-#define LOW_SHADOW_SIZE (0xfffefffULL)
-#define GAP_SHADOW_SIZE (0x1ffffffffff)
-
-#define SHADOW_OFFSET (0x7fff8000ULL)
-#define SHADOW_SCALE 3
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #include "learnsan.h"
-#define MEM_TO_SHADOW(mem) (((mem) >> SHADOW_SCALE) + (SHADOW_OFFSET))
-
-void learnsan_init() {
-   if (mmap(HIGH_SHADOW_ADDR, HIGH_SHADOW_SIZE, PROT_READ | PROT_WRITE,
-              MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
-              0) == MAP_FAILED) {
-        perror("Failed to mmap HIGH_SHADOW memory\n");
-    }
-
-    if(mmap(LOW_SHADOW_ADDR, LOW_SHADOW_SIZE, PROT_READ | PROT_WRITE,
-              MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
-              0) == MAP_FAILED) {
 
-        perror("Failed to mmap LOW_SHADOW memory\n");
+#define GRANULE_MASK (SHADOW_GRANULE - 1)
+#define PAGE_MASK 0xfffULL
+
+static void map_shadow(uintptr_t beg, uintptr_t end, int prot, const char* name) {
+    // the bounds of coarse shadows aren't page aligned
+    beg &= ~PAGE_MASK;
+    end = (end + PAGE_MASK) & ~PAGE_MASK;
+    if (mmap((void*) beg, end - beg, prot,
+             MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
+             0) == MAP_FAILED) {
+        fprintf(stderr, "Failed to mmap %s memory\n", name);
     }
+}
 
-    if(mmap(GAP_SHADOW_ADDR, GAP_SHADOW_SIZE, PROT_NONE,
-              MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
-              0) == MAP_FAILED) {
-        perror("Failed to mmap GAP_SHADOW memory\n");
-
-    }
+void learnsan_init() {
+    map_shadow(HIGH_SHADOW_BEG, HIGH_SHADOW_END, PROT_READ | PROT_WRITE, "HIGH_SHADOW");
+    map_shadow(LOW_SHADOW_BEG, LOW_SHADOW_END, PROT_READ | PROT_WRITE, "LOW_SHADOW");
+    // rounded inwards, the shadow regions keep their partial pages
+    map_shadow((GAP_SHADOW_BEG + PAGE_MASK) & ~PAGE_MASK, (GAP_SHADOW_END + 1) & ~PAGE_MASK,
+               PROT_NONE, "GAP_SHADOW");
 }
 
 int learnsan_poison(void* ptr, size_t size, uint8_t poison_byte) {
 
     uintptr_t ptr_int = (uintptr_t) ptr;
     uintptr_t ptr_int_end = ptr_int + size;
-    uintptr_t ptr_int_end_aligned = ptr_int_end & ~7;
+    uintptr_t ptr_int_end_aligned = ptr_int_end & ~GRANULE_MASK;
 
     //fprintf(stderr, "poisoning mem at addr %lx of size %zu with byte %d\n", ptr_int, size, poison_byte);
-    if (ptr_int & 7) {
+    if (ptr_int & GRANULE_MASK) {
         
-        unsigned long ptr_int_aligned = (ptr_int & ~7) + 8;
+        unsigned long ptr_int_aligned = (ptr_int & ~GRANULE_MASK) + SHADOW_GRANULE;
         size_t first_size = ptr_int_aligned - ptr_int;
 
         if (size < first_size)
@@ -59,7 +52,7 @@ int learnsan_poison(void* ptr, size_t size, uint8_t poison_byte) {
         uintptr_t mem = ptr_int;
         uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
         //fprintf(stderr, "\tshadow addr %p\n", shadow_addr);
-        *shadow_addr = 8 - first_size;
+        *shadow_addr = SHADOW_GRANULE - first_size;
         ptr_int = ptr_int_aligned;
     }
 
@@ -68,7 +61,7 @@ int learnsan_poison(void* ptr, size_t size, uint8_t poison_byte) {
         uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
         //fprintf(stderr, "\tshadow addr %p\n", shadow_addr);
         *shadow_addr = poison_byte;
-        ptr_int += 8;
+        ptr_int += SHADOW_GRANULE;
     }
     return 1;
 }
@@ -82,7 +75,7 @@ int learnsan_unpoison(void* ptr, size_t size) {
         uintptr_t mem = ptr_int;
         uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
         *shadow_addr = 0;
-        ptr_int += 8;
+        ptr_int += SHADOW_GRANULE;
     }
     return 1;
 }
@@ -93,23 +86,35 @@ int learnsan_load1(void* ptr) {
     uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
     int8_t content = *shadow_addr;
     //fprintf(stderr, "++++ Read from shadow addr %p (%lu) with content %u\n", shadow_addr, mem, content);
-    return (content != 0 && ((int)((mem & 7) + 1) > content));
+    return (content != 0 && ((int)((mem & GRANULE_MASK) + 1) > content));
 }
 
 
 
+int learnsan_load2(void* ptr) {
+    uintptr_t mem = (uintptr_t)ptr;
+    uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
+    int8_t content = *shadow_addr;
+    return (content != 0 && ((int)((mem & GRANULE_MASK) + 2) > content));
+}
+
 int learnsan_load4(void* ptr) {
     uintptr_t mem = (uintptr_t)ptr;
     uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
     int8_t content = *shadow_addr;
     //fprintf(stderr, "++++ Read from shadow addr %p (%lu) with content %u\n", shadow_addr, mem, content);
-    return (content != 0 && ((int)((mem & 7) + 4) > content));
+    return (content != 0 && ((int)((mem & GRANULE_MASK) + 4) > content));
 }
 
 int learnsan_load8(void* ptr) {
     uintptr_t mem = (uintptr_t)ptr;
     uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
+#if SHADOW_SCALE == 3
     return *shadow_addr != 0;
+#else
+    int8_t content = *shadow_addr;
+    return (content != 0 && ((int)((mem & GRANULE_MASK) + 8) > content));
+#endif
 }
 
 int learnsan_store1(void* ptr) {
@@ -117,7 +122,15 @@ int learnsan_store1(void* ptr) {
     uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
     int8_t content = *shadow_addr;
     //fprintf(stderr, "++++ Write from shadow addr %p (%lu) with content %u\n", shadow_addr, mem, content);
-    int res = (content != 0 && ((int)((mem & 7) + 1) > content));
+    int res = (content != 0 && ((int)((mem & GRANULE_MASK) + 1) > content));
+    return res;
+}
+
+int learnsan_store2(void* ptr) {
+    uintptr_t mem = (uintptr_t)ptr;
+    uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
+    int8_t content = *shadow_addr;
+    int res = (content != 0 && ((int)((mem & GRANULE_MASK) + 2) > content));
     return res;
 }
 
@@ -126,12 +139,83 @@ int learnsan_store4(void* ptr) {
     uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
     int8_t content = *shadow_addr;
     //fprintf(stderr, "++++ Write from shadow addr %p (%lu) with content %u\n", shadow_addr, mem, content);
-    int res = (content != 0 && ((int)((mem & 7) + 4) > content));
+    int res = (content != 0 && ((int)((mem & GRANULE_MASK) + 4) > content));
     return res;
 }
 
 int learnsan_store8(void* ptr) {
     uintptr_t mem = (uintptr_t)ptr;
     uint8_t* shadow_addr = (uint8_t*) MEM_TO_SHADOW(mem);
+#if SHADOW_SCALE == 3
     return *shadow_addr != 0;
+#else
+    int8_t content = *shadow_addr;
+    return (content != 0 && ((int)((mem & GRANULE_MASK) + 8) > content));
+#endif
+}
+
+
+/*
+ * Returns non zero if all the n shadow bytes starting at shadow are zero.
+ * The shadow is scanned 32 bytes at a time with AVX2
+ * and 8 bytes at a time otherwise.
+ */
+static int shadow_is_clean(const uint8_t* shadow, size_t n) {
+#if defined(__AVX2__)
+    while (n >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) shadow);
+        if (!_mm256_testz_si256(v, v))
+            return 0;
+        shadow += 32;
+        n -= 32;
+    }
+#endif
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, shadow, 8);
+        if (v)
+            return 0;
+        shadow += 8;
+        n -= 8;
+    }
+    while (n--) {
+        if (*shadow++)
+            return 0;
+    }
+    return 1;
+}
+
+int learnsan_check_range(void* ptr, size_t size) {
+    uintptr_t begin = (uintptr_t) ptr;
+    uintptr_t end = begin + size;
+    uintptr_t begin_aligned = (begin + GRANULE_MASK) & ~GRANULE_MASK;
+    uintptr_t end_aligned = end & ~GRANULE_MASK;
+
+    if (size == 0)
+        return 0;
+
+    if (begin_aligned > end_aligned) {
+        // the whole range lives in a single granule
+        int8_t content = *(int8_t*) MEM_TO_SHADOW(begin);
+        return (content != 0 && ((int)((end - 1) & GRANULE_MASK) + 1 > content));
+    }
+
+    // a partial granule at the beginning must be fully addressable
+    if (begin != begin_aligned && *(int8_t*) MEM_TO_SHADOW(begin) != 0)
+        return 1;
+
+    if (!shadow_is_clean((const uint8_t*) MEM_TO_SHADOW(begin_aligned),
+                         (end_aligned - begin_aligned) >> SHADOW_SCALE))
+        return 1;
+
+    if (end != end_aligned) {
+        int8_t content = *(int8_t*) MEM_TO_SHADOW(end_aligned);
+        return (content != 0 && ((int)(end & GRANULE_MASK) > content));
+    }
+
+    return 0;
+}
+
+uint8_t learnsan_get_shadow(void* ptr) {
+    return *(uint8_t*) MEM_TO_SHADOW((uintptr_t) ptr);
 }
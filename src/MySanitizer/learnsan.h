@@ -6,16 +6,39 @@
 #include <inttypes.h>
 #include <sys/mman.h>
 
-#define HIGH_SHADOW_ADDR ((void*)0x02008fff7000ULL)
-#define LOW_SHADOW_ADDR ((void*)0x00007fff8000ULL)
-#define GAP_SHADOW_ADDR ((void*)0x00008fff7000)
+/*
+ * One shadow byte describes a granule of 1 << SHADOW_SCALE bytes of memory.
+ * The scale is chosen at build time (make SHADOW_SCALE=3..6): coarser granules
+ * shrink the shadow to 1/16..1/64 of the memory in use, at the price of
+ * redzones and alignments rounded up to the granule. The pass must be given
+ * the same value in LEARNSAN_SHADOW_SCALE, __learnsan_check_scale refuses
+ * objects instrumented for another one.
+ */
+#ifndef SHADOW_SCALE
+#define SHADOW_SCALE 3
+#endif
 
-#define HIGH_SHADOW_SIZE (0xdfff0000fffULL)
-#define LOW_SHADOW_SIZE (0xfffefffULL)
-#define GAP_SHADOW_SIZE (0x1ffffffffff)
+#if SHADOW_SCALE < 3 || SHADOW_SCALE > 6
+#error "SHADOW_SCALE must be between 3 and 6"
+#endif
 
+#define SHADOW_GRANULE (1ULL << SHADOW_SCALE)
 #define SHADOW_OFFSET (0x7fff8000ULL)
-#define SHADOW_SCALE 3
+
+#define MEM_TO_SHADOW(mem) (((mem) >> SHADOW_SCALE) + (SHADOW_OFFSET))
+
+/*
+ * x86_64 layout, as in ASan: the low memory ends right below SHADOW_OFFSET,
+ * the high memory begins right after the shadow of the whole address space.
+ * The shadow of the shadow is the (inaccessible) gap.
+ */
+#define HIGH_MEM_END 0x7fffffffffffULL
+#define LOW_SHADOW_BEG SHADOW_OFFSET
+#define LOW_SHADOW_END MEM_TO_SHADOW(SHADOW_OFFSET - 1)
+#define HIGH_SHADOW_END MEM_TO_SHADOW(HIGH_MEM_END)
+#define HIGH_SHADOW_BEG MEM_TO_SHADOW(HIGH_SHADOW_END + 1)
+#define GAP_SHADOW_BEG (LOW_SHADOW_END + 1)
+#define GAP_SHADOW_END (HIGH_SHADOW_BEG - 1)
 
 
 
@@ -28,6 +51,7 @@
 #define ASAN_PARTIAL5 0x05
 #define ASAN_PARTIAL6 0x06
 #define ASAN_PARTIAL7 0x07
+/* ... up to SHADOW_GRANULE - 1 addressable bytes */
 #define ASAN_ARRAY_COOKIE 0xac
 #define ASAN_STACK_RZ 0xf0
 #define ASAN_STACK_LEFT_RZ 0xf1
@@ -42,6 +66,11 @@
 #define ASAN_HEAP_RIGHT_RZ 0xfb
 #define ASAN_HEAP_FREED 0xfd
 
+/* kind of a faulting access, as passed to __learnsan_check_access */
+#define LEARNSAN_ACCESS_LOAD 0
+#define LEARNSAN_ACCESS_STORE 1
+#define LEARNSAN_ACCESS_FREE 2
+
 
 
 void learnsan_init();
@@ -50,9 +79,15 @@ int learnsan_poison(void* ptr, size_t s, uint8_t poison_byte);
 int learnsan_unpoison(void* ptr, size_t s);
 
 int learnsan_load1(void* ptr);
+int learnsan_load2(void* ptr);
 int learnsan_load4(void* ptr);
 int learnsan_load8(void* ptr);
 
 int learnsan_store1(void* ptr);
+int learnsan_store2(void* ptr);
 int learnsan_store4(void* ptr);
 int learnsan_store8(void* ptr);
+
+int learnsan_check_range(void* ptr, size_t size);
+
+uint8_t learnsan_get_shadow(void* ptr);
@@ -2,8 +2,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include "allocator.h"
@@ -11,40 +15,271 @@
 
 #define CALLSTACK_MAX 1000
 
-char* callstack[CALLSTACK_MAX];
-unsigned top = 0;
+/* checks emitted in sampling mode run about once every LEARNSAN_SAMPLE_RATE accesses */
+#define DEFAULT_SAMPLE_RATE 1000
+
+/*
+ * In recover mode (LEARNSAN_RECOVER=1) a bad access doesn't abort: it is
+ * recorded in a lock-free hash set keyed by (pc, access kind) and execution
+ * goes on. The unique reports are printed once, at exit or when a fatal
+ * signal arrives. At most LEARNSAN_MAX_REPORTS distinct sites are kept.
+ */
+#define DEFAULT_MAX_REPORTS 256
+#define REPORT_TABLE_SIZE 4096 /* power of two, bigger than any sane cap */
+
+/*
+ * Every thread keeps its own shadow callstack. The pass passes constant
+ * strings, so only the pointers are stored. Frames deeper than CALLSTACK_MAX
+ * are counted but not recorded.
+ */
+static __thread const char* callstack[CALLSTACK_MAX];
+static __thread unsigned top = 0;
+
+__thread int __learnsan_sample_counter;
+static unsigned sample_rate = DEFAULT_SAMPLE_RATE;
+
+struct report {
+    uintptr_t key; /* pc << 2 | kind, 0 for an empty slot */
+    uintptr_t addr;
+    size_t size;
+    unsigned long hits;
+};
+
+static struct report reports[REPORT_TABLE_SIZE];
+static int recover_mode = 0;
+static unsigned max_reports = DEFAULT_MAX_REPORTS;
+static unsigned unique_reports = 0;
+static unsigned long dropped_reports = 0;
+static int reports_flushed = 0;
+
+static void flush_reports();
+static void install_signal_handlers();
+
+/* emitted by the pass for every padded global, see InstrumentGlobals */
+struct learnsan_global {
+    void* beg;
+    size_t size;
+    size_t size_with_redzone;
+};
+
+static int initialized = 0;
 
 __attribute__((constructor, no_sanitize("address", "memory"))) void init() {
    // Here you can place initialization code 
+    // module constructors registering globals may get here first
+    if (initialized)
+        return;
+    initialized = 1;
+
+    char* env = getenv("LEARNSAN_SAMPLE_RATE");
+    if (env)
+        sample_rate = strtoul(env, NULL, 0);
+
+    env = getenv("LEARNSAN_RECOVER");
+    if (env && atoi(env))
+        recover_mode = 1;
+
+    env = getenv("LEARNSAN_MAX_REPORTS");
+    if (env) {
+        max_reports = strtoul(env, NULL, 0);
+        if (max_reports > REPORT_TABLE_SIZE / 2)
+            max_reports = REPORT_TABLE_SIZE / 2;
+    }
+
+    if (recover_mode)
+        install_signal_handlers();
+
     __init_all();
 }
 
-void push_call(char* fcn_name) {
-    size_t s = strlen(fcn_name);
-    char* dst = (char*) malloc(s + 1);
-    strcpy(dst, fcn_name);
-    callstack[top] = dst;
+__attribute__((destructor, no_sanitize("address", "memory"))) void fini() {
+    if (recover_mode)
+        flush_reports();
+    __fini_all();
+}
+
+/* called first by the constructor of every instrumented module */
+extern void __learnsan_check_scale(unsigned long scale) {
+    if (scale != SHADOW_SCALE) {
+        fprintf(stderr, "learnsanitizer: module instrumented with shadow scale %lu, "
+                        "the runtime was built with %d\n", scale, SHADOW_SCALE);
+        abort();
+    }
+}
+
+/*
+ * Called by the instrumented code before a call that doesn't return and
+ * before a resume: longjmp or the unwinder leave frames without running their
+ * epilogues, so their redzones would stay poisoned under the next calls. As
+ * ASan does, the shadow of the stack is cleared from here up to the top of the
+ * thread's stack, which also drops the redzones of the frames still alive.
+ */
+static __thread uintptr_t stack_bottom, stack_top;
+
+static void init_stack_bounds() {
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr))
+        return;
+    if (!pthread_attr_getstack(&attr, &addr, &size)) {
+        stack_bottom = (uintptr_t) addr;
+        stack_top = (uintptr_t) addr + size;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+extern void __learnsan_handle_no_return() {
+    char local;
+    uintptr_t sp = (uintptr_t) &local & ~(SHADOW_GRANULE - 1);
+    if (!stack_top)
+        init_stack_bounds();
+    /* on a signal stack or a coroutine stack, not ours to clear */
+    if (sp < stack_bottom || sp >= stack_top)
+        return;
+    memset((void*) MEM_TO_SHADOW(sp), 0, MEM_TO_SHADOW(stack_top) - MEM_TO_SHADOW(sp));
+}
+
+extern void __learnsan_register_globals(struct learnsan_global* globals, size_t n) {
+    init();
+    for (size_t i = 0; i < n; i++)
+        learnsan_poison((char*) globals[i].beg + globals[i].size,
+                        globals[i].size_with_redzone - globals[i].size, ASAN_GLOBAL_RZ);
+}
+
+static inline void push_call(const char* fcn_name) {
     if (top < CALLSTACK_MAX)
-        top++;
+        callstack[top] = fcn_name;
+    top++;
 }
 
-void pop_call() {
-    free(callstack[top]);
-    callstack[top] = NULL;
-    if (top >= 1)
+static inline void pop_call() {
+    if (top > 0)
         top--;
 }
 
-void crash_and_report() {
-    fprintf(stderr, "learnsanitizer detected an heap memory corruption\n");    
+
+static const char* kind_name(int kind) {
+    static const char* names[] = { "load", "store", "free" };
+    return names[kind];
+}
+
+static void print_access(void* pc, int kind, void* addr, size_t size) {
+    Dl_info info;
+    fprintf(stderr, "invalid %s of size %zu at %p (shadow 0x%02x) from pc %p",
+            kind_name(kind), size, addr, learnsan_get_shadow(addr), pc);
+    if (dladdr(pc, &info) && info.dli_sname)
+        fprintf(stderr, " in %s+0x%lx", info.dli_sname,
+                (unsigned long)((uintptr_t)pc - (uintptr_t)info.dli_saddr));
+    else if (info.dli_fname)
+        fprintf(stderr, " in %s+0x%lx", info.dli_fname,
+                (unsigned long)((uintptr_t)pc - (uintptr_t)info.dli_fbase));
+    fprintf(stderr, "\n");
+}
+
+void crash_and_report(void* pc, int kind, void* addr, size_t size) {
+    fprintf(stderr, "learnsanitizer detected a memory corruption\n");    
+    print_access(pc, kind, addr, size);
     fprintf(stderr, "callstack depth %u\n", top);
-    for (int i = 0; i < top; i++) {
+    for (unsigned i = 0; i < top && i < CALLSTACK_MAX; i++) {
         fprintf(stderr, "%s\n", callstack[i]);
     }
     abort();
 }
 
 
+static inline uintptr_t report_hash(uintptr_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+/*
+ * Adds one hit to the report of (pc, kind). A new slot is claimed with a CAS
+ * on its key, after a unique report has been reserved against the cap, so
+ * concurrent threads never lock and never record the same site twice.
+ */
+static void record_report(void* pc, int kind, void* addr, size_t size) {
+    uintptr_t key = ((uintptr_t) pc << 2) | kind;
+    uintptr_t i = report_hash(key);
+
+    for (unsigned probe = 0; probe < REPORT_TABLE_SIZE; probe++, i++) {
+        struct report* r = &reports[i & (REPORT_TABLE_SIZE - 1)];
+        uintptr_t cur = __atomic_load_n(&r->key, __ATOMIC_ACQUIRE);
+
+        if (cur == 0) {
+            if (__atomic_fetch_add(&unique_reports, 1, __ATOMIC_RELAXED) >= max_reports) {
+                __atomic_fetch_sub(&unique_reports, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&dropped_reports, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            if (__atomic_compare_exchange_n(&r->key, &cur, key, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                r->addr = (uintptr_t) addr;
+                r->size = size;
+                __atomic_fetch_add(&r->hits, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            // somebody else took the slot, give the reservation back
+            __atomic_fetch_sub(&unique_reports, 1, __ATOMIC_RELAXED);
+        }
+
+        if (cur == key) {
+            __atomic_fetch_add(&r->hits, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+static void flush_reports() {
+    if (__atomic_exchange_n(&reports_flushed, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    unsigned n = __atomic_load_n(&unique_reports, __ATOMIC_ACQUIRE);
+    if (n == 0)
+        return;
+
+    fprintf(stderr, "learnsanitizer detected %u unique memory errors\n", n);
+    for (unsigned i = 0; i < REPORT_TABLE_SIZE; i++) {
+        struct report* r = &reports[i];
+        uintptr_t key = __atomic_load_n(&r->key, __ATOMIC_ACQUIRE);
+        if (key == 0)
+            continue;
+        print_access((void*)(key >> 2), key & 3, (void*) r->addr, r->size);
+        fprintf(stderr, "    hit %lu times\n", __atomic_load_n(&r->hits, __ATOMIC_RELAXED));
+    }
+    if (dropped_reports)
+        fprintf(stderr, "%lu errors dropped, LEARNSAN_MAX_REPORTS=%u reached\n",
+                dropped_reports, max_reports);
+}
+
+static void fatal_signal_handler(int sig) {
+    flush_reports();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void install_signal_handlers() {
+    static const int signals[] = { SIGINT, SIGTERM, SIGABRT, SIGSEGV, SIGBUS };
+
+    for (unsigned i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        struct sigaction old;
+        // don't step on handlers installed by the program or the fuzzer
+        if (sigaction(signals[i], NULL, &old) == 0 && old.sa_handler == SIG_DFL)
+            signal(signals[i], fatal_signal_handler);
+    }
+}
+
+static inline __attribute__((always_inline))
+void report_error(void* pc, int kind, void* addr, size_t size) {
+    if (recover_mode)
+        record_report(pc, kind, addr, size);
+    else
+        crash_and_report(pc, kind, addr, size);
+}
+
+
 // Hooking
 
 extern void *__hook_malloc(size_t size) {
@@ -55,39 +290,207 @@ extern void *__hook_malloc(size_t size) {
 }
 
 extern void __hook_free(void* ptr) {
-    __learnsan_free(ptr);
-	return;
+    if (__learnsan_free(ptr))
+        report_error(__builtin_return_address(0), LEARNSAN_ACCESS_FREE, ptr, 0);
 }
 
+extern void *__hook_calloc(size_t n, size_t size) {
+    return __learnsan_calloc(n, size);
+}
 
-extern void __hook_store(long addr, unsigned int size) {
+extern void *__hook_realloc(void* ptr, size_t size) {
+    void* p;
+    if (__learnsan_realloc(ptr, size, &p))
+        report_error(__builtin_return_address(0), LEARNSAN_ACCESS_FREE, ptr, 0);
+    return p;
+}
+
+static inline int is_power_of_2(size_t x) {
+    return x && !(x & (x - 1));
+}
+
+extern int __hook_posix_memalign(void** res, size_t alignment, size_t size) {
+    if (!is_power_of_2(alignment) || alignment % sizeof(void*))
+        return EINVAL;
+    void* p = __learnsan_memalign(alignment, size);
+    if (!p)
+        return ENOMEM;
+    *res = p;
+    return 0;
+}
+
+extern void *__hook_memalign(size_t alignment, size_t size) {
+    if (!is_power_of_2(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return __learnsan_memalign(alignment, size);
+}
 
+extern void *__hook_aligned_alloc(size_t alignment, size_t size) {
+    return __hook_memalign(alignment, size);
+}
+
+extern char *__hook_strdup(const char* s) {
+    size_t n = strlen(s) + 1;
+    char* p = __learnsan_malloc(n);
+    if (p)
+        memcpy(p, s, n);
+    return p;
+}
+
+extern char *__hook_strndup(const char* s, size_t max) {
+    size_t n = strnlen(s, max);
+    char* p = __learnsan_malloc(n + 1);
+    if (p) {
+        memcpy(p, s, n);
+        p[n] = 0;
+    }
+    return p;
+}
+
+/*
+ * C++ allocation functions. The runtime is C, so the throwing operator new
+ * cannot raise std::bad_alloc and aborts instead.
+ */
+
+static void out_of_memory(size_t size) {
+    fprintf(stderr, "learnsanitizer: operator new failed to allocate %zu bytes\n", size);
+    abort();
+}
+
+extern void *__hook_new(size_t size) {
+    void* p = __learnsan_malloc(size);
+    if (!p)
+        out_of_memory(size);
+    return p;
+}
+
+extern void *__hook_new_nothrow(size_t size, const void* tag) {
+    return __learnsan_malloc(size);
+}
+
+extern void *__hook_new_aligned(size_t size, size_t alignment) {
+    void* p = __learnsan_memalign(alignment, size);
+    if (!p)
+        out_of_memory(size);
+    return p;
+}
+
+extern void *__hook_new_aligned_nothrow(size_t size, size_t alignment, const void* tag) {
+    return __learnsan_memalign(alignment, size);
+}
+
+// The sized and aligned operator delete only differ in what they tell
+// the allocator, the chunk header already knows both.
+#define DELETE_HOOK(name, ...)                                                   \
+    extern void name(void* ptr, ##__VA_ARGS__) {                                 \
+        if (__learnsan_free(ptr))                                                \
+            report_error(__builtin_return_address(0), LEARNSAN_ACCESS_FREE, ptr, 0); \
+    }
+
+DELETE_HOOK(__hook_delete)
+DELETE_HOOK(__hook_delete_sized, size_t size)
+DELETE_HOOK(__hook_delete_aligned, size_t alignment)
+DELETE_HOOK(__hook_delete_sized_aligned, size_t size, size_t alignment)
+DELETE_HOOK(__hook_delete_nothrow, const void* tag)
+DELETE_HOOK(__hook_delete_aligned_nothrow, size_t alignment, const void* tag)
+
+
+/*
+ * The checks take the pc of the instrumented access from their caller, so
+ * that the sampled slow paths and the libc interceptors report (and dedupe
+ * on) the user code instead of themselves.
+ */
+
+static inline __attribute__((always_inline))
+void check_store(void* pc, long addr, unsigned int size) {
     void* ptr = (void*) addr;
     int res = __learnsan_store(ptr, size);
     if (res != 0) {
-        crash_and_report();
+        report_error(pc, LEARNSAN_ACCESS_STORE, ptr, size);
     }
-
 }
 
-extern void __hook_load(long addr, unsigned int size) {
-
-    void* ptr = (void*)addr;
+static inline __attribute__((always_inline))
+void check_load(void* pc, long addr, unsigned int size) {
+    void* ptr = (void*) addr;
     int res = __learnsan_load(ptr, size);
     if (res != 0) {
-        crash_and_report();
+        report_error(pc, LEARNSAN_ACCESS_LOAD, ptr, size);
+    }
+}
+
+static inline __attribute__((always_inline))
+void check_range(void* pc, int kind, long addr, size_t size) {
+    void* ptr = (void*) addr;
+    int res = __learnsan_check_range(ptr, size);
+    if (res != 0) {
+        report_error(pc, kind, ptr, size);
     }
-    
+}
+
+/* slow path of the checks inlined from learnsan-rt.bc, the caller is the access */
+extern __attribute__((noinline)) void __learnsan_report(int kind, long addr, size_t size) {
+    report_error(__builtin_return_address(0), kind, (void*) addr, size);
+}
+
+extern void __learnsan_check_access(void* pc, int kind, long addr, size_t size) {
+    check_range(pc, kind, addr, size);
+}
+
+
+extern void __hook_store(long addr, unsigned int size) {
+    check_store(__builtin_return_address(0), addr, size);
+}
+
+extern void __hook_load(long addr, unsigned int size) {
+    check_load(__builtin_return_address(0), addr, size);
+}
+
+
+extern void __hook_store_range(long addr, size_t size) {
+    check_range(__builtin_return_address(0), LEARNSAN_ACCESS_STORE, addr, size);
+}
+
+extern void __hook_load_range(long addr, size_t size) {
+    check_range(__builtin_return_address(0), LEARNSAN_ACCESS_LOAD, addr, size);
+}
+
+
+/*
+ * Slow paths of the sampling mode: the instrumented code decrements
+ * __learnsan_sample_counter inline and only calls these when it drops to zero.
+ */
+
+extern void __hook_sampled_store(long addr, unsigned int size) {
+    __learnsan_sample_counter = __learnsan_next_sample_period(sample_rate);
+    check_store(__builtin_return_address(0), addr, size);
+}
+
+extern void __hook_sampled_load(long addr, unsigned int size) {
+    __learnsan_sample_counter = __learnsan_next_sample_period(sample_rate);
+    check_load(__builtin_return_address(0), addr, size);
+}
+
+extern void __hook_sampled_store_range(long addr, size_t size) {
+    __learnsan_sample_counter = __learnsan_next_sample_period(sample_rate);
+    check_range(__builtin_return_address(0), LEARNSAN_ACCESS_STORE, addr, size);
+}
+
+extern void __hook_sampled_load_range(long addr, size_t size) {
+    __learnsan_sample_counter = __learnsan_next_sample_period(sample_rate);
+    check_range(__builtin_return_address(0), LEARNSAN_ACCESS_LOAD, addr, size);
 }
 
 
-extern void __hook_entry(char* name) {
+extern void __hook_entry(const char* name) {
     //fprintf(stderr, "==> %s\n", name);
     push_call(name);
 }
 
 
-extern void __hook_exit(char* name) {
+extern void __hook_exit(const char* name) {
     //fprintf(stderr, "<== %s\n", name);
     pop_call();
 }
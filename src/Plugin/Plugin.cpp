@@ -0,0 +1,104 @@
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <cstdlib>
+
+#include "Anderson.h"
+#include "Plugin.h"
+
+using namespace llvm;
+
+/*
+ * All the passes in one plugin for the new pass manager:
+ *
+ *   opt -load-pass-plugin=./SecurityPasses.so -passes=fuzzing,learnsan
+ *   clang -fpass-plugin=./SecurityPasses.so, with SECURITY_PASSES=fuzzing,learnsan
+ *
+ * The passes take the instructions they instrument from the shared
+ * InstructionIndex, so the module is walked once for all of them. FuzzingPass
+ * only adds code and keeps the index, which LearnSanitizer then reuses: it
+ * would skip the instrumentation of FuzzingPass, marked nosanitize, anyway.
+ */
+
+AnalysisKey InstructionIndexAnalysis::Key;
+AnalysisKey AndersonAnalysis::Key;
+
+InstructionIndexAnalysis::Result InstructionIndexAnalysis::run(Module &M, ModuleAnalysisManager &) {
+  return InstructionIndex(M);
+}
+
+// SECURITY_PASSES: the passes added to the clang pipelines, a comma separated
+// list of hello, anderson, fuzzing and learnsan
+struct EnabledPasses {
+  bool Hello = false, Anderson = false, Fuzzing = false, LearnSanitizer = false;
+
+  EnabledPasses() {
+    const char *Passes = getenv("SECURITY_PASSES");
+    if (!Passes)
+      return;
+
+    SmallVector<StringRef, 4> Names;
+    StringRef(Passes).split(Names, ',', -1, false);
+    for (StringRef Name : Names) {
+      if (Name == "hello")
+        Hello = true;
+      else if (Name == "anderson")
+        Anderson = true;
+      else if (Name == "fuzzing")
+        Fuzzing = true;
+      else if (Name == "learnsan")
+        LearnSanitizer = true;
+      else
+        report_fatal_error("SecurityPasses: SECURITY_PASSES must list hello, anderson, fuzzing or learnsan");
+    }
+  }
+};
+
+static void registerCallbacks(PassBuilder &PB) {
+
+  PB.registerAnalysisRegistrationCallback([](ModuleAnalysisManager &MAM) {
+    MAM.registerPass([] { return InstructionIndexAnalysis(); });
+    MAM.registerPass([] { return AndersonAnalysis(); });
+  });
+
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "hello")
+          MPM.addPass(HelloPass());
+        else if (Name == "anderson")
+          MPM.addPass(AndersonPrinterPass());
+        else if (Name == "fuzzing")
+          MPM.addPass(FuzzingPass());
+        else if (Name == "learnsan")
+          MPM.addPass(LearnSanitizerPass());
+        else
+          return false;
+        return true;
+      });
+
+  // the same extension points as the legacy plugins, at -O0 too; the
+  // link time instrumentation of FUZZING_SEQUENTIAL_IDS needs the legacy
+  // FuzzingPass.so
+  EnabledPasses Enabled;
+
+  if (Enabled.Hello)
+    PB.registerPipelineStartEPCallback([](ModulePassManager &MPM, auto) {
+      MPM.addPass(HelloPass());
+    });
+
+  if (Enabled.Anderson || Enabled.Fuzzing || Enabled.LearnSanitizer)
+    PB.registerOptimizerLastEPCallback([Enabled](ModulePassManager &MPM, auto) {
+      if (Enabled.Anderson)
+        MPM.addPass(AndersonPrinterPass());
+      if (Enabled.Fuzzing)
+        MPM.addPass(FuzzingPass(true));
+      if (Enabled.LearnSanitizer)
+        MPM.addPass(LearnSanitizerPass());
+    });
+
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "SecurityPasses", LLVM_VERSION_STRING, registerCallbacks};
+}
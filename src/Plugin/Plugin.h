@@ -0,0 +1,53 @@
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include "llvm/IR/PassManager.h"
+
+#include <memory>
+
+#include "InstructionIndex.h"
+
+using namespace llvm;
+
+/*
+ * New pass manager versions of the passes, built into a single plugin with
+ * -DSECURITY_PLUGIN. The run() methods live next to the legacy passes they
+ * wrap, the analysis keys and the registration in Plugin.cpp.
+ */
+
+struct AndersonAnalysisModulePass;
+
+// the instructions of the module, shared by the passes until one erases some
+struct InstructionIndexAnalysis : AnalysisInfoMixin<InstructionIndexAnalysis> {
+    using Result = InstructionIndex;
+    Result run(Module& M, ModuleAnalysisManager& MAM);
+    static AnalysisKey Key;
+};
+
+// the solved points-to sets, required by LearnSanitizer to elide checks
+struct AndersonAnalysis : AnalysisInfoMixin<AndersonAnalysis> {
+    using Result = std::unique_ptr<AndersonAnalysisModulePass>;
+    Result run(Module& M, ModuleAnalysisManager& MAM);
+    static AnalysisKey Key;
+};
+
+struct AndersonPrinterPass : PassInfoMixin<AndersonPrinterPass> {
+    PreservedAnalyses run(Module& M, ModuleAnalysisManager& MAM);
+};
+
+struct HelloPass : PassInfoMixin<HelloPass> {
+    PreservedAnalyses run(Module& M, ModuleAnalysisManager& MAM);
+};
+
+// PreLink when added to the clang pipelines, see PassStage in FuzzingPass.cpp
+struct FuzzingPass : PassInfoMixin<FuzzingPass> {
+    bool IsPreLink;
+    explicit FuzzingPass(bool IsPreLink = false) : IsPreLink(IsPreLink) {}
+    PreservedAnalyses run(Module& M, ModuleAnalysisManager& MAM);
+};
+
+struct LearnSanitizerPass : PassInfoMixin<LearnSanitizerPass> {
+    PreservedAnalyses run(Module& M, ModuleAnalysisManager& MAM);
+};
+
+#endif